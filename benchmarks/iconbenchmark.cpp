@@ -0,0 +1,525 @@
+/*
+ * This file is part of CuteCosmic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "cutecosmiccolormanager.h"
+#include "cutecosmiciconengine.h"
+#include "cutecosmiciconindex.h"
+#include "cutecosmiciconrenderer.h"
+#include "cutecosmicrecolor.h"
+#include "cutecosmicsvgcache.h"
+
+#include "bindings.h"
+
+#include <QGuiApplication>
+#include <QIcon>
+#include <QTemporaryDir>
+#include <QTest>
+
+#include <atomic>
+#include <cerrno>
+#include <iterator>
+#include <memory>
+
+using namespace Qt::StringLiterals;
+
+/*
+ * Benchmarks for the icon rendering paths, over the sample icon theme next to
+ * this file: a symbolic icon, an icon with a KDE stylesheet and a full color
+ * one, at the usual sizes and scales. Each row also reports the number of
+ * heap allocations per iteration, and the cache hit rates are reported at the
+ * end. Runs with the offscreen platform and a temporary cache directory.
+ */
+
+static std::atomic<qint64> s_allocations { 0 };
+
+#ifdef __GLIBC__
+// Counting in the malloc() family rather than operator new also catches the
+// Qt containers and images, which allocate with malloc() and realloc()
+// directly. Aligned allocations are forwarded to memalign().
+extern "C" {
+
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* pointer, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+
+void* malloc(size_t size) noexcept
+{
+    s_allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) noexcept
+{
+    s_allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* pointer, size_t size) noexcept
+{
+    s_allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(pointer, size);
+}
+
+void* memalign(size_t alignment, size_t size) noexcept
+{
+    s_allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) noexcept
+{
+    s_allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void** pointer, size_t alignment, size_t size) noexcept
+{
+    if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+
+    s_allocations.fetch_add(1, std::memory_order_relaxed);
+    void* result = __libc_memalign(alignment, size);
+    if (!result) {
+        return ENOMEM;
+    }
+
+    *pointer = result;
+    return 0;
+}
+
+}
+#endif
+
+namespace {
+
+// Reports the heap allocations (calls to the malloc() family) per iteration
+// of the benchmark loop it is used in, where they can be counted
+class AllocationCounter
+{
+public:
+    AllocationCounter()
+        : d_start(s_allocations.load())
+        , d_iterations(0)
+    {
+    }
+
+    ~AllocationCounter()
+    {
+#ifdef __GLIBC__
+        if (d_iterations > 0) {
+            qInfo("%s: %.1f heap allocations per iteration", QTest::currentDataTag(),
+                double(s_allocations.load() - d_start) / d_iterations);
+        }
+#endif
+    }
+
+    void iteration() { d_iterations++; }
+
+private:
+    qint64 d_start;
+    qint64 d_iterations;
+};
+
+struct CorpusIcon
+{
+    const char* name;
+    const char* file;
+};
+
+const CorpusIcon CORPUS[] = {
+    { "document-save-symbolic", "actions/scalable/document-save-symbolic.svg" },
+    { "edit-copy", "actions/scalable/edit-copy.svg" },
+    { "utilities-terminal", "apps/scalable/utilities-terminal.svg" },
+};
+
+// Names a KDE application typically creates icons for at startup, none of
+// which are in the sample theme
+const char* const MISSING_NAMES[] = {
+    "application-exit", "configure", "configure-shortcuts", "configure-toolbars",
+    "dialog-close", "document-close", "document-export", "document-import",
+    "document-new", "document-print", "document-print-preview", "document-properties",
+    "document-revert", "document-save-as", "edit-clear", "edit-cut",
+    "edit-delete", "edit-find", "edit-find-replace", "edit-paste",
+    "edit-redo", "edit-select-all", "edit-undo", "go-down",
+    "go-next", "go-previous", "go-up", "help-about",
+    "help-contents", "kde", "view-fullscreen", "view-refresh",
+    "zoom-in", "zoom-original", "zoom-out", "zoom-fit-best",
+};
+
+// The icons of a typical KDE toolbar: a raster icon that only comes in 16 and
+// 22 pixel versions (as in Oxygen or older Breeze), and scalable ones
+const char* const TOOLBAR_ICONS[] = {
+    "document-open", "document-save-symbolic", "edit-copy", "utilities-terminal",
+};
+
+// How many icons are created per iteration in the engine creation benchmark,
+// in the range of the actions of a large KDE application
+const int CREATED_ICONS = 1000;
+
+const int SIZES[] = { 16, 24, 32, 48, 64, 128, 256 };
+const qreal SCALES[] = { 1.0, 1.25, 2.0 };
+
+QString themeDirectory()
+{
+    return QLatin1StringView(CUTECOSMIC_BENCHMARK_ICONS) + "/cutecosmic-benchmark"_L1;
+}
+
+}
+
+class IconBenchmark : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void initTestCase();
+    void cleanupTestCase();
+
+    // Preprocessing, parsing and rendering an SVG file, without any cache
+    void renderCold_data() { addIconRows(); }
+    void renderCold();
+
+    // Through the icon engine with the in-memory pixmap cache disabled, so
+    // from the disk cache, or from the cached mask for symbolic icons
+    void renderUncachedPixmap_data() { addIconRows(); }
+    void renderUncachedPixmap();
+
+    // Through a new icon engine, from the in-memory pixmap cache
+    void renderWarm_data() { addIconRows(); }
+    void renderWarm();
+
+    // Coloring a symbolic icon's mask
+    void colorizeMask_data();
+    void colorizeMask();
+
+    // Resolving the icons an application needs at startup, through
+    // QIconLoader or through the icon theme index, including opening it
+    void resolveNames_data();
+    void resolveNames();
+
+    // Creating icon engines that are never painted, as for the actions of
+    // menus that are never opened
+    void createEngines();
+
+    // Pixels rendered for toolbar icons at the usual toolbar sizes, against
+    // the pixels that were asked for
+    void renderedPixels_data();
+    void renderedPixels();
+
+private:
+    static void addIconRows();
+    static CuteCosmicIconIndex::Themes indexThemes();
+    static void reportCache(const char* name, const CuteCosmicIconRenderer& renderer);
+
+    std::unique_ptr<CuteCosmicColorManager> d_colorManager;
+    std::unique_ptr<CuteCosmicIconRenderer> d_renderer;
+    std::unique_ptr<CuteCosmicIconRenderer> d_uncachedRenderer;
+};
+
+void IconBenchmark::initTestCase()
+{
+    QIcon::setThemeSearchPaths({ QLatin1StringView(CUTECOSMIC_BENCHMARK_ICONS) });
+    QIcon::setThemeName("cutecosmic-benchmark"_L1);
+    QVERIFY(QIcon::hasThemeIcon("edit-copy"_L1));
+
+    libcosmic_theme_load(CosmicThemeKind::Dark);
+    d_colorManager = std::make_unique<CuteCosmicColorManager>();
+    d_colorManager->reloadThemeColors();
+
+    d_renderer = std::make_unique<CuteCosmicIconRenderer>(d_colorManager.get());
+
+    // The budget is read when the cache is created
+    qputenv("CUTECOSMIC_ICON_CACHE_SIZE", "0");
+    d_uncachedRenderer = std::make_unique<CuteCosmicIconRenderer>(d_colorManager.get());
+    qunsetenv("CUTECOSMIC_ICON_CACHE_SIZE");
+
+    std::atomic<bool> cancelled { false };
+    QString indexPath = CuteCosmicIconIndex::indexPath(indexThemes());
+    QVERIFY(CuteCosmicIconIndex::build(indexPath, indexThemes(), cancelled));
+
+    qInfo("SVG renderer: %s", CuteCosmicSvgCache::usesResvg() ? "resvg" : "QtSvg");
+}
+
+void IconBenchmark::cleanupTestCase()
+{
+    reportCache("Warm renderer", *d_renderer);
+
+    CuteCosmicSvgCache* svgCache = CuteCosmicSvgCache::instance();
+    qint64 parsed = svgCache->misses();
+    qint64 reused = svgCache->hits();
+    qInfo("SVG documents: %lld parsed, %lld reused (%.1f%%)",
+        static_cast<long long>(parsed),
+        static_cast<long long>(reused),
+        parsed + reused > 0 ? 100.0 * reused / (parsed + reused) : 0.0);
+
+    d_uncachedRenderer.reset();
+    d_renderer.reset();
+    d_colorManager.reset();
+}
+
+void IconBenchmark::addIconRows()
+{
+    QTest::addColumn<QString>("name");
+    QTest::addColumn<QString>("path");
+    QTest::addColumn<int>("size");
+    QTest::addColumn<qreal>("scale");
+
+    for (const CorpusIcon& icon : CORPUS) {
+        QString path = themeDirectory() + u'/' + QLatin1StringView(icon.file);
+        for (int size : SIZES) {
+            for (qreal scale : SCALES) {
+                QTest::addRow("%s-%d@%g", icon.name, size, scale)
+                    << QLatin1StringView(icon.name).toString() << path << size << scale;
+            }
+        }
+    }
+}
+
+CuteCosmicIconIndex::Themes IconBenchmark::indexThemes()
+{
+    return CuteCosmicIconIndex::Themes {
+        QIcon::themeName(),
+        QIcon::fallbackThemeName(),
+        QIcon::themeSearchPaths()
+    };
+}
+
+void IconBenchmark::reportCache(const char* name, const CuteCosmicIconRenderer& renderer)
+{
+    const char* categories[] = { "symbolic", "full color", "raster" };
+    for (int category = 0; category < CuteCosmicIconCache::CategoryCount; category++) {
+        CuteCosmicIconCache::Stats stats = renderer.cache().stats(static_cast<CuteCosmicIconCache::Category>(category));
+        if (stats.hits + stats.misses > 0) {
+            qInfo("%s, %s icons: %lld hits, %lld misses (%.1f%%)", name, categories[category],
+                static_cast<long long>(stats.hits),
+                static_cast<long long>(stats.misses),
+                stats.hitRate() * 100);
+        }
+    }
+}
+
+void IconBenchmark::renderCold()
+{
+    QFETCH(QString, path);
+    QFETCH(int, size);
+    QFETCH(qreal, scale);
+
+    const QString iconCss = d_colorManager->iconCss();
+    const int pixels = qRound(size * scale);
+
+    AllocationCounter allocations;
+    QBENCHMARK {
+        CuteCosmicSvgCache cache;
+        auto document = cache.document(path, iconCss);
+        QVERIFY(document && document->isValid());
+        QImage image = document->render(QSize(pixels, pixels));
+        QVERIFY(!image.isNull());
+        allocations.iteration();
+    }
+}
+
+void IconBenchmark::renderUncachedPixmap()
+{
+    QFETCH(QString, name);
+    QFETCH(int, size);
+    QFETCH(qreal, scale);
+
+    // The first render fills the disk cache
+    QVERIFY(!CuteCosmicIconEngine(name, d_uncachedRenderer.get()).scaledPixmap(QSize(size, size), QIcon::Normal, QIcon::Off, scale).isNull());
+
+    AllocationCounter allocations;
+    QBENCHMARK {
+        CuteCosmicIconEngine engine { name, d_uncachedRenderer.get() };
+        QPixmap pixmap = engine.scaledPixmap(QSize(size, size), QIcon::Normal, QIcon::Off, scale);
+        QVERIFY(!pixmap.isNull());
+        allocations.iteration();
+    }
+}
+
+void IconBenchmark::renderWarm()
+{
+    QFETCH(QString, name);
+    QFETCH(int, size);
+    QFETCH(qreal, scale);
+
+    QVERIFY(!CuteCosmicIconEngine(name, d_renderer.get()).scaledPixmap(QSize(size, size), QIcon::Normal, QIcon::Off, scale).isNull());
+
+    AllocationCounter allocations;
+    QBENCHMARK {
+        CuteCosmicIconEngine engine { name, d_renderer.get() };
+        QPixmap pixmap = engine.scaledPixmap(QSize(size, size), QIcon::Normal, QIcon::Off, scale);
+        QVERIFY(!pixmap.isNull());
+        allocations.iteration();
+    }
+}
+
+void IconBenchmark::colorizeMask_data()
+{
+    QTest::addColumn<int>("pixels");
+
+    for (int size : SIZES) {
+        for (qreal scale : SCALES) {
+            int pixels = qRound(size * scale);
+            QTest::addRow("%d", pixels) << pixels;
+        }
+    }
+}
+
+void IconBenchmark::colorizeMask()
+{
+    QFETCH(int, pixels);
+
+    QImage mask { pixels, pixels, QImage::Format_Alpha8 };
+    for (int y = 0; y < pixels; y++) {
+        uchar* line = mask.scanLine(y);
+        for (int x = 0; x < pixels; x++) {
+            line[x] = static_cast<uchar>((x * 255) / qMax(pixels - 1, 1));
+        }
+    }
+
+    AllocationCounter allocations;
+    QBENCHMARK {
+        QImage image = cuteCosmicColorizeMask(mask, qRgb(0x23, 0x26, 0x29));
+        QVERIFY(!image.isNull());
+        allocations.iteration();
+    }
+}
+
+void IconBenchmark::resolveNames_data()
+{
+    QStringList present;
+    for (const CorpusIcon& icon : CORPUS) {
+        present.append(QLatin1StringView(icon.name).toString());
+    }
+
+    QStringList missing;
+    for (const char* name : MISSING_NAMES) {
+        missing.append(QLatin1StringView(name).toString());
+    }
+
+    QTest::addColumn<bool>("useIndex");
+    QTest::addColumn<QStringList>("names");
+
+    QTest::addRow("QIconLoader-present") << false << present;
+    QTest::addRow("QIconLoader-missing") << false << missing;
+    QTest::addRow("index-present") << true << present;
+    QTest::addRow("index-missing") << true << missing;
+}
+
+void IconBenchmark::resolveNames()
+{
+    QFETCH(bool, useIndex);
+    QFETCH(QStringList, names);
+
+    const CuteCosmicIconIndex::Themes themes = indexThemes();
+    const QString indexPath = CuteCosmicIconIndex::indexPath(themes);
+
+    AllocationCounter allocations;
+    QBENCHMARK {
+        qsizetype found = 0;
+        if (useIndex) {
+            std::unique_ptr<CuteCosmicIconIndex> index = CuteCosmicIconIndex::open(indexPath, themes);
+            QVERIFY(index);
+            for (const QString& name : std::as_const(names)) {
+                found += index->find(name).size();
+            }
+        }
+        else {
+            for (const QString& name : std::as_const(names)) {
+                found += QIconLoader::instance()->loadIcon(name).entries.size();
+            }
+        }
+        Q_UNUSED(found);
+        allocations.iteration();
+    }
+}
+
+void IconBenchmark::createEngines()
+{
+    QStringList names;
+    for (int i = 0; i < CREATED_ICONS; i++) {
+        names.append(QLatin1StringView(MISSING_NAMES[i % std::size(MISSING_NAMES)]) + u'-' + QString::number(i));
+    }
+
+    AllocationCounter allocations;
+    QBENCHMARK {
+        for (const QString& name : std::as_const(names)) {
+            QIcon icon { new CuteCosmicIconEngine(name, d_renderer.get()) };
+            Q_UNUSED(icon);
+        }
+        allocations.iteration();
+    }
+}
+
+void IconBenchmark::renderedPixels_data()
+{
+    QTest::addColumn<int>("size");
+    QTest::addColumn<qreal>("scale");
+
+    for (int size : { 16, 22, 32, 48 }) {
+        for (qreal scale : SCALES) {
+            QTest::addRow("%d@%g", size, scale) << size << scale;
+        }
+    }
+}
+
+void IconBenchmark::renderedPixels()
+{
+    QFETCH(int, size);
+    QFETCH(qreal, scale);
+
+    // Like QToolButton and most styles, ask for the actual size first
+    qint64 requested = 0;
+    qint64 rendered = 0;
+
+    for (const char* name : TOOLBAR_ICONS) {
+        CuteCosmicIconEngine engine { QLatin1StringView(name).toString(), d_renderer.get() };
+
+        QSize actualSize = engine.actualSize(QSize(size, size), QIcon::Normal, QIcon::Off);
+        QPixmap pixmap = engine.scaledPixmap(actualSize, QIcon::Normal, QIcon::Off, scale);
+        QVERIFY(!pixmap.isNull());
+
+        int requestedPixels = qRound(size * scale);
+        requested += qint64(requestedPixels) * requestedPixels;
+        rendered += qint64(pixmap.width()) * pixmap.height();
+    }
+
+    qInfo("%s: %lld pixels requested, %lld rendered (%.1f%%)", QTest::currentDataTag(),
+        static_cast<long long>(requested),
+        static_cast<long long>(rendered),
+        100.0 * rendered / requested);
+}
+
+int main(int argc, char** argv)
+{
+    // Don't touch the display or the caches of the user
+    if (!qEnvironmentVariableIsSet("QT_QPA_PLATFORM")) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+
+    QTemporaryDir cacheDirectory;
+    if (!cacheDirectory.isValid()) {
+        qFatal("Can't create a temporary cache directory");
+    }
+    qputenv("XDG_CACHE_HOME", QFile::encodeName(cacheDirectory.path()));
+
+    QGuiApplication app { argc, argv };
+    IconBenchmark benchmark;
+    return QTest::qExec(&benchmark, argc, argv);
+}
+
+#include "iconbenchmark.moc"
@@ -24,6 +24,7 @@ fn main() {
     cbindgen::Builder::new()
         .with_crate(manifest_dir)
         .with_language(Language::Cxx)
+        .with_define("feature", "resvg", "CUTECOSMIC_RESVG")
         .generate()
         .map_or_else(
             |error| match error {
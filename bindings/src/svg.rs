@@ -0,0 +1,104 @@
+/*
+ * This file is part of CuteCosmic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+use resvg::{tiny_skia, usvg};
+
+/// A parsed SVG document, rendered with resvg as an alternative to QtSvg
+pub struct CosmicSvg {
+    tree: usvg::Tree,
+}
+
+// Documents are shared between the icon rendering threads, and rendered from
+// any of them at the same time
+const _: () = {
+    const fn assert_send_sync<T: Send + Sync>() {}
+    assert_send_sync::<CosmicSvg>();
+};
+
+/// Parses an SVG document (optionally gzip compressed) from a buffer, which
+/// doesn't need to outlive the call. Returns null if it isn't valid.
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn libcosmic_svg_load(data: *const u8, len: usize) -> *mut CosmicSvg {
+    if data.is_null() || len == 0 {
+        return std::ptr::null_mut();
+    }
+
+    // SAFETY: The C++ code passes a buffer of at least len readable bytes
+    let data = unsafe { std::slice::from_raw_parts(data, len) };
+
+    match usvg::Tree::from_data(data, &usvg::Options::default()) {
+        Ok(tree) => Box::into_raw(Box::new(CosmicSvg { tree })),
+        Err(_) => std::ptr::null_mut(),
+    }
+}
+
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn libcosmic_svg_free(svg: *mut CosmicSvg) {
+    if svg.is_null() {
+        return;
+    }
+
+    // SAFETY: We checked for a null pointer, and assume that the C++ code will
+    // only call this function on pointers received from libcosmic_svg_load
+    let _ = unsafe { Box::from_raw(svg) };
+}
+
+/// Renders the document stretched over a width x height buffer of
+/// premultiplied 32-bit ARGB pixels in native byte order (like
+/// `QImage::Format_ARGB32_Premultiplied`), over its existing contents. Rows
+/// must be tightly packed. Can be called from any thread.
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn libcosmic_svg_render(
+    svg: *const CosmicSvg,
+    pixels: *mut u8,
+    width: u32,
+    height: u32,
+    stride: usize,
+) -> bool {
+    // SAFETY: The C++ code only passes pointers received from
+    // libcosmic_svg_load, that weren't freed yet
+    let Some(svg) = (unsafe { svg.as_ref() }) else {
+        return false;
+    };
+    if pixels.is_null() || stride != width as usize * 4 {
+        return false;
+    }
+
+    // SAFETY: The C++ code passes a buffer of stride * height writable bytes,
+    // that nothing else accesses during the call
+    let data = unsafe { std::slice::from_raw_parts_mut(pixels, stride * height as usize) };
+
+    let Some(mut pixmap) = tiny_skia::PixmapMut::from_bytes(data, width, height) else {
+        return false;
+    };
+
+    let size = svg.tree.size();
+    #[allow(clippy::cast_precision_loss)]
+    let transform = tiny_skia::Transform::from_scale(
+        width as f32 / size.width(),
+        height as f32 / size.height(),
+    );
+    resvg::render(&svg.tree, transform, &mut pixmap);
+
+    // tiny-skia stores pixels as premultiplied RGBA bytes, so convert them in
+    // place rather than have the caller make another pass
+    for pixel in pixmap.data_mut().chunks_exact_mut(4) {
+        let argb = u32::from_be_bytes([pixel[3], pixel[0], pixel[1], pixel[2]]);
+        pixel.copy_from_slice(&argb.to_ne_bytes());
+    }
+
+    true
+}
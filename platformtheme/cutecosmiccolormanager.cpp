@@ -15,44 +15,106 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 #include "cutecosmiccolormanager.h"
+#include "cutecosmicpaths.h"
 
 #include "bindings.h"
 
 #include <QCoreApplication>
+#include <QCryptographicHash>
+#include <QDateTime>
 #include <QDir>
+#include <QGuiApplication>
 #include <QLoggingCategory>
 #include <QPalette>
-#include <QSaveFile>
 #include <QTemporaryFile>
 #include <QTextStream>
+#include <QTimeZone>
+#include <QTimer>
+
+#include <cstdio>
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 using namespace Qt::StringLiterals;
 
 Q_DECLARE_LOGGING_CATEGORY(lcCuteCosmic)
 
+// Enough for the whole generated color scheme, so that it's built without
+// reallocating
+static constexpr qsizetype KDE_COLORS_RESERVE = 4096;
+
+// Color scheme files of previous themes that are kept around, and how long
+// files stay at least, as other processes may still be using them
+static constexpr qsizetype MAX_KDE_COLORS_FILES = 16;
+static constexpr qint64 MIN_KDE_COLORS_FILE_AGE_SECS = 24 * 60 * 60;
+
+struct CuteCosmicColorManager::IconCssColors
+{
+    QColor text;
+    QColor background;
+    QColor highlightedText;
+    QColor accent;
+    QColor positive;
+    QColor neutral;
+    QColor negative;
+};
+
 CuteCosmicColorManager::CuteCosmicColorManager(QObject* parent)
     : QObject(parent)
+    , d_kdeColorsDirty(false)
+    , d_kdeColorsRequired(false)
+    , d_iconCssDirty(false)
+    , d_iconCssHash(0)
 {
-    QString templateName = "/cutecosmic_%1_XXXXXX.colors"_L1.arg(QCoreApplication::applicationName());
+    // Applications usually load KDE Frameworks plugins (e.g a Qt Quick style)
+    // after the platform theme, but before entering the event loop. Others
+    // are only loaded along with a window (e.g a KIO file dialog or a KPart),
+    // so check again whenever another window gets the focus, to keep the
+    // color scheme file from being pruned while it's in use.
+    QTimer::singleShot(0, this, &CuteCosmicColorManager::updateKdeColors);
+    d_kdeColorsProbe = connect(qGuiApp, &QGuiApplication::focusWindowChanged, this, &CuteCosmicColorManager::updateKdeColors);
+}
 
-    d_kdeColorsFile = new QTemporaryFile(this);
-    d_kdeColorsFile->setFileTemplate(QDir::tempPath() + templateName);
-    if (!d_kdeColorsFile->open()) {
-        qCWarning(lcCuteCosmic(),
-            "Can't open temporary file for writing, KDE colorscheme won't be exported");
+void CuteCosmicColorManager::reloadThemeColors()
+{
+    rebuildPalettes();
+    rebuildKdeColors();
+
+    // The hash is all that the icon caches need to tell that the stylesheet
+    // changed, and it doesn't need the stylesheet itself
+    d_iconCssDirty = true;
+    if (d_systemPalette) {
+        IconCssColors colors = iconCssColors();
+        d_iconCssHash = qHashMulti(0,
+            colors.text.rgba(),
+            colors.background.rgba(),
+            colors.highlightedText.rgba(),
+            colors.accent.rgba(),
+            colors.positive.rgba(),
+            colors.neutral.rgba(),
+            colors.negative.rgba());
     }
     else {
-        qCDebug(lcCuteCosmic(),
-            "KDE color scheme will be written to %s",
-            qPrintable(d_kdeColorsFile->fileName()));
+        d_iconCssHash = 0;
     }
 }
 
-void CuteCosmicColorManager::reloadThemeColors()
+void CuteCosmicColorManager::requireKdeColors()
 {
-    rebuildPalettes();
-    rebuildKdeColors();
-    rebuildKdeIconCss();
+    d_kdeColorsRequired = true;
+    disconnect(d_kdeColorsProbe);
+    updateKdeColors();
+}
+
+QString CuteCosmicColorManager::iconCss()
+{
+    if (d_iconCssDirty) {
+        d_iconCssDirty = false;
+        rebuildKdeIconCss();
+    }
+    return d_iconCss;
 }
 
 static QColor convertColor(const CosmicColor& color)
@@ -197,21 +259,130 @@ struct ColorConfigEntry
     QColor color;
 };
 
-static QTextStream& operator<<(QTextStream& stream, const ColorConfigEntry& entry)
+struct ColorSchemeBuffer
+{
+    QByteArray data;
+};
+
+static ColorSchemeBuffer& operator<<(ColorSchemeBuffer& buffer, const char* text)
 {
-    stream << entry.key << "=" << entry.color.red() << "," << entry.color.green() << "," << entry.color.blue() << "\n";
-    return stream;
+    buffer.data += text;
+    return buffer;
 }
 
-void CuteCosmicColorManager::rebuildKdeColors()
+static ColorSchemeBuffer& operator<<(ColorSchemeBuffer& buffer, const ColorConfigEntry& entry)
+{
+    char line[64];
+    int length = std::snprintf(line, sizeof(line), "%s=%d,%d,%d\n",
+        entry.key, entry.color.red(), entry.color.green(), entry.color.blue());
+    buffer.data.append(line, qMin<int>(length, sizeof(line) - 1));
+    return buffer;
+}
+
+static void pruneKdeColorsFiles(const QString& directory, const QString& current)
+{
+    const QFileInfoList files = QDir(directory).entryInfoList({ "*.colors"_L1 }, QDir::Files, QDir::Time);
+    const QDateTime minModified = QDateTime::currentDateTimeUtc().addSecs(-MIN_KDE_COLORS_FILE_AGE_SECS);
+
+    for (qsizetype i = MAX_KDE_COLORS_FILES; i < files.size(); i++) {
+        if (files[i].filePath() != current && files[i].lastModified(QTimeZone::UTC) < minModified) {
+            QFile::remove(files[i].filePath());
+        }
+    }
+}
+
+// Color schemes are stored by their contents in the cache directory, so all
+// the applications of the session share a single file for each theme, and
+// only the first one to get to it writes it
+static QString kdeColorsFilePath(const QByteArray& contents)
+{
+    QString directory = cuteCosmicCacheDirectory();
+    if (directory.isEmpty()) {
+        return QString();
+    }
+
+    QByteArray hash = QCryptographicHash::hash(contents, QCryptographicHash::Sha1).toHex();
+    return directory + "/colors/"_L1 + QString::fromLatin1(hash.first(16)) + ".colors"_L1;
+}
+
+static bool isKdeColorsFileWritten(const QString& path, const QByteArray& contents)
+{
+    // A file that is cut short would have been left by a crash
+    QFileInfo info { path };
+    return info.exists() && info.size() == contents.size();
+}
+
+static bool writeKdeColorsFile(const QString& path, const QByteArray& contents)
+{
+    // Files that are reused are touched, so that they count as recent when
+    // pruning
+    if (isKdeColorsFileWritten(path, contents)) {
+        ::utimensat(AT_FDCWD, QFile::encodeName(path).constData(), nullptr, 0);
+        return true;
+    }
+
+    QString directory = QFileInfo(path).path();
+    if (!QDir().mkpath(directory)) {
+        return false;
+    }
+
+    // The file is written in one go under a temporary name, and then renamed
+    // into place. Renaming never replaces an existing file, so if it fails
+    // someone else has just written the same contents.
+    QTemporaryFile file { directory + "/XXXXXX.tmp"_L1 };
+    if (!file.open() || file.write(contents) != contents.size()) {
+        return false;
+    }
+
+    if (!file.rename(path)) {
+        return isKdeColorsFileWritten(path, contents);
+    }
+
+    file.setAutoRemove(false);
+    pruneKdeColorsFiles(directory, path);
+    return true;
+}
+
+static bool isKColorSchemeLoaded()
+{
+    // KColorScheme is what reads KDE_COLOR_SCHEME_PATH, and it's either linked
+    // into the application or loaded along with a KDE plugin
+    void* handle = dlopen("libKF6ColorScheme.so.6", RTLD_LAZY | RTLD_NOLOAD);
+    if (!handle) {
+        return false;
+    }
+
+    dlclose(handle);
+    return true;
+}
+
+void CuteCosmicColorManager::updateKdeColors()
 {
-    if (!d_kdeColorsFile->isOpen()) {
+    if (!d_kdeColorsDirty) {
         return;
     }
 
+    if (!d_kdeColorsRequired) {
+        if (!isKColorSchemeLoaded()) {
+            return;
+        }
+        d_kdeColorsRequired = true;
+        disconnect(d_kdeColorsProbe);
+    }
+
+    d_kdeColorsDirty = false;
+    if (!writeKdeColorsFile(d_kdeColorsPath, d_kdeColors)) {
+        qCWarning(lcCuteCosmic(), "Can't write the KDE color scheme to %s", qPrintable(d_kdeColorsPath));
+    }
+}
+
+void CuteCosmicColorManager::rebuildKdeColors()
+{
+    QCoreApplication* app = QCoreApplication::instance();
+    d_kdeColorsDirty = false;
+
     if (!libcosmic_theme_should_apply_colors()) {
-        QCoreApplication* app = QCoreApplication::instance();
-        if (app->property("KDE_COLOR_SCHEME_PATH").toString() == d_kdeColorsFile->fileName()) {
+        if (!d_kdeColorsPath.isEmpty() && app->property("KDE_COLOR_SCHEME_PATH").toString() == d_kdeColorsPath) {
             app->setProperty("KDE_COLOR_SCHEME_PATH", QVariant());
         }
         return;
@@ -240,12 +411,8 @@ void CuteCosmicColorManager::rebuildKdeColors()
     QColor neutral = convertColor(ep.warning);
     QColor positive = convertColor(ep.success);
 
-    QSaveFile saveFile { d_kdeColorsFile->fileName() };
-    if (!saveFile.open(QIODeviceBase::WriteOnly)) {
-        return;
-    }
-
-    QTextStream stream { &saveFile };
+    ColorSchemeBuffer stream;
+    stream.data.reserve(KDE_COLORS_RESERVE);
 
     stream << "[Colors:Window]\n";
     stream << ColorConfigEntry { "BackgroundNormal", window };
@@ -373,36 +540,70 @@ void CuteCosmicColorManager::rebuildKdeColors()
     stream << ColorConfigEntry { "DecorationHover", highlight };
     stream << "\n";
 
-    if (saveFile.commit()) {
-        QCoreApplication::instance()->setProperty("KDE_COLOR_SCHEME_PATH", d_kdeColorsFile->fileName());
+    QString path = kdeColorsFilePath(stream.data);
+    if (path.isEmpty()) {
+        qCWarning(lcCuteCosmic(), "No cache directory for the KDE color scheme, it won't be exported");
+        return;
+    }
+
+    // The path only depends on the contents, so it's advertised right away,
+    // as KColorScheme may be read before we'd notice it's loaded. Only the
+    // file is left for later, unless nobody has written it yet.
+    d_kdeColors = stream.data;
+    if (isKdeColorsFileWritten(path, d_kdeColors)) {
+        d_kdeColorsDirty = true;
+    }
+    else if (!writeKdeColorsFile(path, d_kdeColors)) {
+        qCWarning(lcCuteCosmic(), "Can't write the KDE color scheme, it won't be exported");
+        return;
     }
+
+    if (path != d_kdeColorsPath) {
+        qCDebug(lcCuteCosmic(), "KDE color scheme is at %s", qPrintable(path));
+        d_kdeColorsPath = path;
+    }
+    app->setProperty("KDE_COLOR_SCHEME_PATH", d_kdeColorsPath);
+
+    updateKdeColors();
 }
 
-void CuteCosmicColorManager::rebuildKdeIconCss()
+CuteCosmicColorManager::IconCssColors CuteCosmicColorManager::iconCssColors() const
 {
     Q_ASSERT(d_systemPalette.get() != nullptr);
 
     CosmicExtendedPalette ep;
     libcosmic_theme_get_extended_palette(&ep);
 
-    QColor windowText = d_systemPalette->color(QPalette::Active, QPalette::WindowText);
-    QColor windowBackground = d_systemPalette->color(QPalette::Active, QPalette::Window);
-    QColor highlightedText = d_systemPalette->color(QPalette::Active, QPalette::HighlightedText);
-    QColor accent = d_systemPalette->color(QPalette::Active, QPalette::Accent);
-    QColor negative = convertColor(ep.destructive);
-    QColor neutral = convertColor(ep.warning);
-    QColor positive = convertColor(ep.success);
+    return IconCssColors {
+        d_systemPalette->color(QPalette::Active, QPalette::WindowText),
+        d_systemPalette->color(QPalette::Active, QPalette::Window),
+        d_systemPalette->color(QPalette::Active, QPalette::HighlightedText),
+        d_systemPalette->color(QPalette::Active, QPalette::Accent),
+        convertColor(ep.success),
+        convertColor(ep.warning),
+        convertColor(ep.destructive)
+    };
+}
 
+void CuteCosmicColorManager::rebuildKdeIconCss()
+{
     d_iconCss.clear();
+
+    // Without COSMIC colors there is nothing to build the stylesheet from
+    if (!d_systemPalette) {
+        return;
+    }
+
+    IconCssColors colors = iconCssColors();
     QTextStream stream { &d_iconCss };
 
-    stream << ".ColorScheme-Text{ color:" << windowText.name() << "; } ";
-    stream << ".ColorScheme-Background{ color:" << windowBackground.name() << "; } ";
-    stream << ".ColorScheme-HighlightedText{ color:" << highlightedText.name() << "; } ";
-    stream << ".ColorScheme-Accent{ color:" << accent.name() << "; }";
-    stream << ".ColorScheme-PositiveText{ color:" << positive.name() << "; } ";
-    stream << ".ColorScheme-NeutralText{ color:" << neutral.name() << "; } ";
-    stream << ".ColorScheme-NegativeText{ color:" << negative.name() << "; } ";
+    stream << ".ColorScheme-Text{ color:" << colors.text.name() << "; } ";
+    stream << ".ColorScheme-Background{ color:" << colors.background.name() << "; } ";
+    stream << ".ColorScheme-HighlightedText{ color:" << colors.highlightedText.name() << "; } ";
+    stream << ".ColorScheme-Accent{ color:" << colors.accent.name() << "; }";
+    stream << ".ColorScheme-PositiveText{ color:" << colors.positive.name() << "; } ";
+    stream << ".ColorScheme-NeutralText{ color:" << colors.neutral.name() << "; } ";
+    stream << ".ColorScheme-NegativeText{ color:" << colors.negative.name() << "; } ";
 }
 
 #include "moc_cutecosmiccolormanager.cpp"
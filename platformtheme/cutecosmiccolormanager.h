@@ -21,8 +21,21 @@
 #include <memory>
 
 class QPalette;
-class QTemporaryFile;
 
+/*
+ * Builds the Qt palettes from the COSMIC theme, along with what KDE software
+ * needs to follow it: a KDE color scheme file, advertised to KDE Frameworks
+ * through the KDE_COLOR_SCHEME_PATH application property, and the stylesheet
+ * for KDE symbolic icons.
+ *
+ * The color scheme file is named after its contents, and its path is set
+ * along with the palettes. The file itself is only written then if no other
+ * application did it first. Otherwise it's only touched once KColorScheme is
+ * loaded in the process (or is known to be about to be), which is checked on
+ * startup, on theme changes and whenever the focus moves to another window.
+ * The icon stylesheet is only built once an icon needs it, theme changes
+ * merely mark it out of date.
+ */
 class CuteCosmicColorManager : QObject
 {
     Q_OBJECT
@@ -31,22 +44,34 @@ public:
     CuteCosmicColorManager(QObject* parent = nullptr);
 
     void reloadThemeColors();
+    void requireKdeColors();
 
     const QPalette* systemPalette() const { return d_systemPalette.get(); }
     const QPalette* menuPalette() const { return d_menuPalette.get(); }
     const QPalette* buttonPalette() const { return d_buttonPalette.get(); }
 
-    QString iconCss() const { return d_iconCss; }
+    QString iconCss();
+    size_t iconCssHash() const { return d_iconCssHash; }
 
 private:
+    struct IconCssColors;
+
     void rebuildPalettes();
+    void updateKdeColors();
     void rebuildKdeColors();
     void rebuildKdeIconCss();
+    IconCssColors iconCssColors() const;
 
     std::unique_ptr<QPalette> d_systemPalette;
     std::unique_ptr<QPalette> d_menuPalette;
     std::unique_ptr<QPalette> d_buttonPalette;
 
-    QTemporaryFile* d_kdeColorsFile;
+    QByteArray d_kdeColors;
+    QString d_kdeColorsPath;
+    bool d_kdeColorsDirty;
+    bool d_kdeColorsRequired;
+    QMetaObject::Connection d_kdeColorsProbe;
     QString d_iconCss;
+    bool d_iconCssDirty;
+    size_t d_iconCssHash;
 };
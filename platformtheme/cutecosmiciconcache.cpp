@@ -0,0 +1,137 @@
+/*
+ * This file is part of CuteCosmic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "cutecosmiciconcache.h"
+
+#include <QLoggingCategory>
+
+Q_DECLARE_LOGGING_CATEGORY(lcCuteCosmic)
+
+static constexpr qint64 DEFAULT_BUDGET_KB = 10 * 1024;
+
+static const char* categoryName(CuteCosmicIconCache::Category category)
+{
+    switch (category) {
+    case CuteCosmicIconCache::Symbolic:
+        return "symbolic";
+    case CuteCosmicIconCache::FullColor:
+        return "full color";
+    case CuteCosmicIconCache::Raster:
+        return "raster";
+    case CuteCosmicIconCache::CategoryCount:
+        break;
+    }
+    return "";
+}
+
+static qint64 pixmapCost(const QPixmap& pixmap)
+{
+    return qMax<qint64>(qint64(pixmap.width()) * pixmap.height() * pixmap.depth() / 8, 1);
+}
+
+CuteCosmicIconCache::CuteCosmicIconCache()
+    : d_budget(DEFAULT_BUDGET_KB * 1024)
+    , d_bytes(0)
+{
+    bool ok;
+    int budget = qEnvironmentVariableIntValue("CUTECOSMIC_ICON_CACHE_SIZE", &ok);
+    if (ok && budget >= 0) {
+        d_budget = qint64(budget) * 1024;
+    }
+}
+
+CuteCosmicIconCache::~CuteCosmicIconCache()
+{
+    for (int category = 0; category < CategoryCount; category++) {
+        const Stats& stats = d_stats[category];
+        if (stats.hits + stats.misses == 0) {
+            continue;
+        }
+
+        qCInfo(lcCuteCosmic(),
+            "Icon cache, %s icons: %lld KiB, %lld hits, %lld misses (%.1f%%), %lld evictions",
+            categoryName(static_cast<Category>(category)),
+            static_cast<long long>(stats.bytes / 1024),
+            static_cast<long long>(stats.hits),
+            static_cast<long long>(stats.misses),
+            stats.hitRate() * 100,
+            static_cast<long long>(stats.evictions));
+    }
+}
+
+bool CuteCosmicIconCache::find(const CuteCosmicIconKey& key, Category category, QPixmap* pixmap)
+{
+    auto it = d_index.constFind(key);
+    if (it == d_index.constEnd()) {
+        d_stats[category].misses++;
+        return false;
+    }
+
+    // Move the entry to the front
+    std::list<Entry>::iterator entry = *it;
+    d_entries.splice(d_entries.begin(), d_entries, entry);
+
+    d_stats[entry->category].hits++;
+    *pixmap = entry->pixmap;
+    return true;
+}
+
+void CuteCosmicIconCache::insert(const CuteCosmicIconKey& key, Category category, const QPixmap& pixmap)
+{
+    qint64 cost = pixmapCost(pixmap);
+    if (cost > d_budget) {
+        return;
+    }
+
+    auto it = d_index.find(key);
+    if (it != d_index.end()) {
+        Entry& entry = **it;
+        d_bytes -= entry.cost;
+        d_stats[entry.category].bytes -= entry.cost;
+        d_entries.erase(*it);
+        d_index.erase(it);
+    }
+
+    evict(d_budget - cost);
+
+    d_entries.push_front(Entry { key, pixmap, category, cost });
+    d_index.insert(key, d_entries.begin());
+    d_bytes += cost;
+    d_stats[category].bytes += cost;
+}
+
+void CuteCosmicIconCache::clear()
+{
+    d_entries.clear();
+    d_index.clear();
+    d_bytes = 0;
+
+    for (Stats& stats : d_stats) {
+        stats.bytes = 0;
+    }
+}
+
+void CuteCosmicIconCache::evict(qint64 budget)
+{
+    while (d_bytes > budget && !d_entries.empty()) {
+        const Entry& entry = d_entries.back();
+        d_bytes -= entry.cost;
+        d_stats[entry.category].bytes -= entry.cost;
+        d_stats[entry.category].evictions++;
+        d_index.remove(entry.key);
+        d_entries.pop_back();
+    }
+}
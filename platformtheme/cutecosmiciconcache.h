@@ -0,0 +1,120 @@
+/*
+ * This file is part of CuteCosmic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <QHash>
+#include <QPixmap>
+#include <QString>
+
+#include <array>
+#include <list>
+
+// Identifies a rendered icon: the file, the size in device pixels and the
+// scale, the mode, and a hash of the theme inputs it was rendered with. The
+// path is shared with the request it comes from, so keys can be built and
+// compared without allocating.
+struct CuteCosmicIconKey
+{
+    QString path;
+    qint32 size;
+    qreal scale;
+    qint32 mode;
+    size_t inputs;
+
+    friend bool operator==(const CuteCosmicIconKey& lhs, const CuteCosmicIconKey& rhs)
+    {
+        return lhs.path == rhs.path
+            && lhs.size == rhs.size
+            && lhs.scale == rhs.scale
+            && lhs.mode == rhs.mode
+            && lhs.inputs == rhs.inputs;
+    }
+
+    friend bool operator!=(const CuteCosmicIconKey& lhs, const CuteCosmicIconKey& rhs)
+    {
+        return !(lhs == rhs);
+    }
+
+    friend size_t qHash(const CuteCosmicIconKey& key, size_t seed = 0)
+    {
+        return qHashMulti(seed, key.path, key.size, key.scale, key.mode, key.inputs);
+    }
+};
+
+/*
+ * Least recently used cache for rendered icon pixmaps, limited by the amount
+ * of pixel memory it holds. It is used instead of QPixmapCache, whose limit is
+ * shared with the style and the rest of the application. The budget defaults
+ * to 10 MiB, and can be set in KiB with the CUTECOSMIC_ICON_CACHE_SIZE
+ * environment variable.
+ *
+ * Usage is accounted separately for each category of icons, and logged with
+ * the cutecosmic.info logging rule when the cache is destroyed.
+ */
+class CuteCosmicIconCache
+{
+public:
+    enum Category
+    {
+        Symbolic,
+        FullColor,
+        Raster,
+        CategoryCount
+    };
+
+    struct Stats
+    {
+        qint64 bytes = 0;
+        qint64 hits = 0;
+        qint64 misses = 0;
+        qint64 evictions = 0;
+
+        qreal hitRate() const { return hits + misses > 0 ? qreal(hits) / (hits + misses) : 0.0; }
+    };
+
+    CuteCosmicIconCache();
+    ~CuteCosmicIconCache();
+
+    qint64 budget() const { return d_budget; }
+    qint64 bytes() const { return d_bytes; }
+    Stats stats(Category category) const { return d_stats[category]; }
+
+    bool contains(const CuteCosmicIconKey& key) const { return d_index.contains(key); }
+    bool find(const CuteCosmicIconKey& key, Category category, QPixmap* pixmap);
+    void insert(const CuteCosmicIconKey& key, Category category, const QPixmap& pixmap);
+    void clear();
+
+private:
+    struct Entry
+    {
+        CuteCosmicIconKey key;
+        QPixmap pixmap;
+        Category category;
+        qint64 cost;
+    };
+
+    void evict(qint64 budget);
+
+    qint64 d_budget;
+    qint64 d_bytes;
+
+    // Most recently used entries are at the front
+    std::list<Entry> d_entries;
+    QHash<CuteCosmicIconKey, std::list<Entry>::iterator> d_index;
+
+    std::array<Stats, CategoryCount> d_stats;
+};
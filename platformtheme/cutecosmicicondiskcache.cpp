@@ -0,0 +1,378 @@
+/*
+ * This file is part of CuteCosmic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "cutecosmicicondiskcache.h"
+#include "cutecosmicpaths.h"
+#include "cutecosmicutils.h"
+
+#include <QFile>
+#include <QLoggingCategory>
+#include <QSaveFile>
+#include <QSet>
+
+#include <algorithm>
+
+#include <sys/file.h>
+#include <sys/stat.h>
+
+using namespace Qt::StringLiterals;
+
+Q_DECLARE_LOGGING_CATEGORY(lcCuteCosmic)
+
+static constexpr quint32 FILE_MAGIC = 0x43494343; // "CCIC"
+static constexpr quint32 FILE_VERSION = 2;
+static constexpr quint32 RECORD_MAGIC = 0x52494343; // "CCIR"
+
+static constexpr qint64 MAX_FILE_SIZE = 64 * 1024 * 1024;
+
+struct FileHeader
+{
+    quint32 magic;
+    quint32 version;
+    quint64 reserved;
+};
+
+struct RecordHeader
+{
+    quint32 magic;
+    quint32 keySize;
+    quint64 keyHash;
+    quint32 width;
+    quint32 height;
+    quint32 bytesPerLine;
+    quint16 format;
+    quint16 checksum;
+    quint64 dataChecksum;
+};
+
+static_assert(sizeof(FileHeader) == 16);
+static_assert(sizeof(RecordHeader) == 40);
+
+struct CuteCosmicIconDiskCache::Mapping
+{
+    QFile file;
+    const uchar* data = nullptr;
+    qint64 size = 0;
+    ino_t inode = 0;
+};
+
+Q_GLOBAL_STATIC(CuteCosmicIconDiskCache, s_diskCache)
+
+static quint16 headerChecksum(RecordHeader header)
+{
+    header.checksum = 0;
+    return qChecksum(QByteArrayView(reinterpret_cast<const char*>(&header), sizeof(RecordHeader)));
+}
+
+static quint64 dataChecksum(const uchar* data, qint64 size)
+{
+    return cuteCosmicStableHash(QByteArrayView(data, size));
+}
+
+static qint64 align8(qint64 value)
+{
+    return (value + 7) & ~qint64(7);
+}
+
+static qint64 recordSize(const RecordHeader& header)
+{
+    return sizeof(RecordHeader) + align8(header.keySize) + align8(qint64(header.bytesPerLine) * header.height);
+}
+
+static bool isValidFile(const uchar* data, qint64 size)
+{
+    if (size < qint64(sizeof(FileHeader))) {
+        return false;
+    }
+
+    FileHeader header;
+    memcpy(&header, data, sizeof(FileHeader));
+    return header.magic == FILE_MAGIC && header.version == FILE_VERSION;
+}
+
+static bool isValidRecord(const RecordHeader& header)
+{
+    return header.magic == RECORD_MAGIC
+        && header.checksum == headerChecksum(header)
+        && header.width > 0
+        && header.height > 0
+        && header.format > QImage::Format_Invalid
+        && header.format < QImage::NImageFormats;
+}
+
+// Calls func(offset, header) for every complete record starting at the given
+// offset, and returns the offset just past the last one
+template<typename Func>
+static qint64 walkRecords(const uchar* data, qint64 size, qint64 offset, Func&& func)
+{
+    while (offset + qint64(sizeof(RecordHeader)) <= size) {
+        RecordHeader header;
+        memcpy(&header, data + offset, sizeof(RecordHeader));
+        if (!isValidRecord(header)) {
+            break;
+        }
+
+        qint64 length = recordSize(header);
+        if (offset + length > size) {
+            break;
+        }
+
+        func(offset, header);
+        offset += length;
+    }
+    return offset;
+}
+
+CuteCosmicIconDiskCache::CuteCosmicIconDiskCache()
+    : d_scanEnd(0)
+{
+    if (qEnvironmentVariableIsSet("CUTECOSMIC_DISABLE_DISK_CACHE")) {
+        return;
+    }
+
+    QString directory = cuteCosmicCacheDirectory();
+    if (directory.isEmpty()) {
+        qCWarning(lcCuteCosmic(), "No cache directory available, icons won't be cached on disk");
+        return;
+    }
+
+    // Rasterization results may differ between Qt versions, so don't share
+    // the file between them
+    d_path = directory + "/icons-"_L1 + QLatin1StringView(QT_VERSION_STR) + ".cache"_L1;
+    d_lockPath = d_path + ".lock"_L1;
+}
+
+CuteCosmicIconDiskCache* CuteCosmicIconDiskCache::instance()
+{
+    return s_diskCache();
+}
+
+QImage CuteCosmicIconDiskCache::find(QByteArrayView key)
+{
+    if (!isEnabled()) {
+        return QImage();
+    }
+
+    QMutexLocker locker { &d_mutex };
+
+    quint64 hash = cuteCosmicStableHash(key);
+    auto it = d_index.constFind(hash);
+    if (it == d_index.constEnd()) {
+        // Some other process might have rendered it since we last looked
+        if (!refresh()) {
+            return QImage();
+        }
+
+        it = d_index.constFind(hash);
+        if (it == d_index.constEnd()) {
+            return QImage();
+        }
+    }
+
+    const uchar* record = d_mapping->data + *it;
+
+    RecordHeader header;
+    memcpy(&header, record, sizeof(RecordHeader));
+
+    const uchar* storedKey = record + sizeof(RecordHeader);
+    if (qsizetype(header.keySize) != key.size() || memcmp(storedKey, key.data(), key.size()) != 0) {
+        return QImage();
+    }
+
+    // The header is checked when the file is scanned, but the pixels only
+    // when they are used. A record that was torn by a crash or corrupted
+    // later on is forgotten, and superseded once the icon is rendered again.
+    const uchar* pixels = storedKey + align8(header.keySize);
+    if (dataChecksum(pixels, qint64(header.bytesPerLine) * header.height) != header.dataChecksum) {
+        d_index.erase(it);
+        return QImage();
+    }
+
+    // The image references the mapped memory directly, so it has to keep the
+    // mapping alive for as long as it exists
+    auto* mapping = new std::shared_ptr<Mapping>(d_mapping);
+    auto cleanup = [](void* info) {
+        delete static_cast<std::shared_ptr<Mapping>*>(info);
+    };
+
+    return QImage(pixels,
+        header.width,
+        header.height,
+        header.bytesPerLine,
+        static_cast<QImage::Format>(header.format),
+        cleanup,
+        mapping);
+}
+
+void CuteCosmicIconDiskCache::insert(QByteArrayView key, const QImage& image)
+{
+    if (!isEnabled() || image.isNull()) {
+        return;
+    }
+
+    QMutexLocker locker { &d_mutex };
+
+    if (!append(key, image)) {
+        qCDebug(lcCuteCosmic(), "Failed to write icon to the disk cache at %s", qPrintable(d_path));
+    }
+}
+
+bool CuteCosmicIconDiskCache::refresh()
+{
+    struct stat st;
+    if (::stat(QFile::encodeName(d_path).constData(), &st) != 0) {
+        return d_mapping != nullptr;
+    }
+
+    if (d_mapping && d_mapping->inode == st.st_ino && d_mapping->size == st.st_size) {
+        return true;
+    }
+
+    auto mapping = std::make_shared<Mapping>();
+    mapping->file.setFileName(d_path);
+    if (!mapping->file.open(QIODevice::ReadOnly)) {
+        return d_mapping != nullptr;
+    }
+
+    // The file might have been replaced again since the stat() call
+    if (::fstat(mapping->file.handle(), &st) != 0) {
+        return d_mapping != nullptr;
+    }
+
+    mapping->size = st.st_size;
+    mapping->inode = st.st_ino;
+    mapping->data = mapping->file.map(0, mapping->size);
+
+    if (!mapping->data || !isValidFile(mapping->data, mapping->size)) {
+        return d_mapping != nullptr;
+    }
+
+    bool replaced = !d_mapping || d_mapping->inode != mapping->inode;
+
+    d_mapping = std::move(mapping);
+    if (replaced) {
+        d_index.clear();
+        d_scanEnd = sizeof(FileHeader);
+    }
+
+    scan(d_scanEnd);
+    return true;
+}
+
+void CuteCosmicIconDiskCache::scan(qint64 from)
+{
+    d_scanEnd = walkRecords(d_mapping->data, d_mapping->size, from, [this](qint64 offset, const RecordHeader& header) {
+        d_index.insert(header.keyHash, offset);
+    });
+}
+
+bool CuteCosmicIconDiskCache::append(QByteArrayView key, const QImage& image)
+{
+    RecordHeader header;
+    header.magic = RECORD_MAGIC;
+    header.keySize = key.size();
+    header.keyHash = cuteCosmicStableHash(key);
+    header.width = image.width();
+    header.height = image.height();
+    header.bytesPerLine = image.bytesPerLine();
+    header.format = image.format();
+    header.dataChecksum = dataChecksum(image.constBits(), image.sizeInBytes());
+    header.checksum = headerChecksum(header);
+
+    QByteArray record(recordSize(header), '\0');
+    char* out = record.data();
+    memcpy(out, &header, sizeof(RecordHeader));
+    memcpy(out + sizeof(RecordHeader), key.data(), key.size());
+    memcpy(out + sizeof(RecordHeader) + align8(key.size()), image.constBits(), image.sizeInBytes());
+
+    // Writers are serialized through a lock on a separate file, so that it
+    // keeps working as the cache file itself gets replaced. The lock is
+    // released when the file is closed.
+    QFile lockFile { d_lockPath };
+    if (!lockFile.open(QIODevice::WriteOnly) || ::flock(lockFile.handle(), LOCK_EX) != 0) {
+        return false;
+    }
+
+    // Other writers are locked out now, so bringing the mapping up to date
+    // only walks the records they appended since it was last scanned
+    refresh();
+
+    QFile file { d_path };
+    struct stat st;
+    if (!file.open(QIODevice::ReadWrite) || ::fstat(file.handle(), &st) != 0) {
+        return false;
+    }
+
+    qint64 end = 0;
+    if (d_mapping && d_mapping->inode == st.st_ino && d_mapping->size == st.st_size) {
+        end = d_scanEnd;
+    }
+
+    if (end > 0 && end == st.st_size && end + record.size() <= MAX_FILE_SIZE) {
+        file.seek(end);
+        return file.write(record) == record.size() && file.flush();
+    }
+
+    // The file is either missing, incompatible, has a torn record at its end
+    // or is over budget - so write a new one with the most recent records that
+    // fit in half the budget, and atomically replace it. Readers never see a
+    // truncated file this way.
+    QList<qint64> kept;
+    QSet<quint64> seenKeys;
+    qint64 keptSize = 0;
+
+    const uchar* data = (end > 0) ? d_mapping->data : nullptr;
+
+    if (end > 0) {
+        QList<QPair<qint64, RecordHeader>> records;
+        walkRecords(data, end, sizeof(FileHeader), [&records](qint64 offset, const RecordHeader& header) {
+            records.append({ offset, header });
+        });
+
+        for (auto it = records.crbegin(); it != records.crend(); ++it) {
+            if (seenKeys.contains(it->second.keyHash) || it->second.keyHash == header.keyHash) {
+                continue;
+            }
+
+            qint64 length = recordSize(it->second);
+            if (keptSize + length > MAX_FILE_SIZE / 2) {
+                break;
+            }
+
+            seenKeys.insert(it->second.keyHash);
+            kept.append(it->first);
+            keptSize += length;
+        }
+        std::reverse(kept.begin(), kept.end());
+    }
+
+    QSaveFile newFile { d_path };
+    if (!newFile.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+
+    FileHeader fileHeader { FILE_MAGIC, FILE_VERSION, 0 };
+    newFile.write(reinterpret_cast<const char*>(&fileHeader), sizeof(FileHeader));
+
+    for (qint64 offset : std::as_const(kept)) {
+        RecordHeader keptHeader;
+        memcpy(&keptHeader, data + offset, sizeof(RecordHeader));
+        newFile.write(reinterpret_cast<const char*>(data + offset), recordSize(keptHeader));
+    }
+
+    newFile.write(record);
+    return newFile.commit();
+}
@@ -0,0 +1,68 @@
+/*
+ * This file is part of CuteCosmic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <QByteArrayView>
+#include <QHash>
+#include <QImage>
+#include <QMutex>
+#include <QString>
+
+#include <memory>
+
+/*
+ * Persistent cache of rendered icon rasters, shared by all the processes of
+ * the user through a single append-only file in the cache directory. Each
+ * process maps the file read-only, and images found in it reference the
+ * mapped memory directly.
+ *
+ * Writers serialize through an advisory lock on a side file. A record only
+ * becomes visible once it is fully written, so a process that crashes during
+ * an append leaves a torn tail which is dropped by the next writer. Records
+ * also carry a checksum of their pixels, which is verified before they are
+ * handed out. When the
+ * file grows beyond its budget (or a torn tail is found) it is compacted into
+ * a new file that atomically replaces the old one - processes that still have
+ * the old file mapped keep using it until they notice the replacement.
+ */
+class CuteCosmicIconDiskCache
+{
+public:
+    CuteCosmicIconDiskCache();
+
+    static CuteCosmicIconDiskCache* instance();
+
+    bool isEnabled() const { return !d_path.isEmpty(); }
+
+    QImage find(QByteArrayView key);
+    void insert(QByteArrayView key, const QImage& image);
+
+private:
+    struct Mapping;
+
+    bool refresh();
+    void scan(qint64 from);
+    bool append(QByteArrayView key, const QImage& image);
+
+    QString d_path;
+    QString d_lockPath;
+
+    QMutex d_mutex;
+    std::shared_ptr<Mapping> d_mapping;
+    QHash<quint64, qint64> d_index;
+    qint64 d_scanEnd;
+};
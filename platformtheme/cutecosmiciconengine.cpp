@@ -1,29 +1,37 @@
 #include "cutecosmiciconengine.h"
-#include "cutecosmiccolormanager.h"
+#include "cutecosmiciconlookup.h"
+#include "cutecosmiciconprofile.h"
+#include "cutecosmiciconrenderer.h"
+#include "cutecosmicutils.h"
 
-#include <QtGui/private/qguiapplication_p.h>
-
-#include <QBuffer>
-#include <QFile>
 #include <QGuiApplication>
-#include <QImageReader>
+#include <QPaintDeviceWindow>
 #include <QPainter>
-#include <QPalette>
-#include <QPixmapCache>
-#include <QTextStream>
-#include <QXmlStreamReader>
+
+#include <limits>
 
 using namespace Qt::Literals;
 
-CuteCosmicIconEngine::CuteCosmicIconEngine(const QString& iconName, CuteCosmicColorManager* colorManager)
-    : d_iconInfo(QIconLoader::instance()->loadIcon(iconName))
-    , d_colorManager(colorManager)
+static bool isSymbolic(const QString& iconName)
+{
+    return iconName.endsWith("-symbolic"_L1)
+        || iconName.endsWith("-symbolic-rtl"_L1);
+}
+
+CuteCosmicIconEngine::CuteCosmicIconEngine(const QString& iconName, CuteCosmicIconRenderer* renderer)
+    : d_iconName(iconName)
+    , d_themeKey(0)
+    , d_sizeMatches {}
+    , d_nextSizeMatch(0)
+    , d_lastRequest {}
+    , d_renderer(renderer)
 {
 }
 
 QIconEngine* CuteCosmicIconEngine::clone() const
 {
-    return new CuteCosmicIconEngine(d_iconInfo.iconName, d_colorManager);
+    // Clones share the resolved icon info (if any), no need to look it up again
+    return new CuteCosmicIconEngine(*this);
 }
 
 QString CuteCosmicIconEngine::key() const
@@ -33,204 +41,240 @@ QString CuteCosmicIconEngine::key() const
 
 QString CuteCosmicIconEngine::iconName()
 {
-    return d_iconInfo.iconName;
+    ensureLoaded();
+    return d_iconInfo->iconName;
 }
 
 bool CuteCosmicIconEngine::isNull()
 {
-    return d_iconInfo.entries.empty();
-}
-
-void CuteCosmicIconEngine::paint(QPainter* painter, const QRect& rect, QIcon::Mode mode, QIcon::State state)
-{
-    qreal scale = (painter->device()) ? painter->device()->devicePixelRatio() : qGuiApp->devicePixelRatio();
-
-    QPixmap pixmap = scaledPixmap(rect.size(), mode, state, scale);
-    if (!pixmap.isNull()) {
-        painter->drawPixmap(rect, pixmap);
+    // QIconLoader asks this right after creating the engine, so don't resolve
+    // the icon just to answer it
+    if (d_iconInfo && d_themeKey == CuteCosmicIconLookup::themeKey()) {
+        return d_iconInfo->entries.empty();
     }
+    return !CuteCosmicIconLookup::instance()->exists(d_iconName);
 }
 
-QPixmap CuteCosmicIconEngine::pixmap(const QSize& size, QIcon::Mode mode, QIcon::State state)
+QSize CuteCosmicIconEngine::actualSize(const QSize& size, QIcon::Mode mode, QIcon::State state)
 {
-    return scaledPixmap(size, mode, state, 1.0);
-}
+    Q_UNUSED(mode);
+    Q_UNUSED(state);
+
+    ensureLoaded();
 
-QPixmap CuteCosmicIconEngine::scaledPixmap(const QSize& size, QIcon::Mode mode, QIcon::State state, qreal scale)
-{
     int iconSize = qMin(size.height(), size.width());
 
-    QString fileName = bestIconFileForSize(iconSize, scale);
-    if (fileName.isEmpty()) {
-        return QPixmap();
+    // Like QIconLoaderEngine, only scalable directories fill any size, and
+    // icons from other directories are never scaled up
+    const CuteCosmicIconEntry* entry = bestEntryForSize(iconSize, 1.0);
+    if (!entry) {
+        return QSize(0, 0);
     }
 
-    QSize targetSize { iconSize, iconSize };
-
-    if (!fileName.endsWith(".svg"_L1)) {
-        QIcon icon { fileName };
-        return icon.pixmap(targetSize, scale, mode, state);
+    if (entry->dir.type == QIconDirInfo::Scalable) {
+        return size;
     }
 
-    QPixmap result = renderSvgIcon(fileName, targetSize * scale, mode, state);
-    result.setDevicePixelRatio(scale);
-    return result;
+    int result = qMin<int>(entry->dir.size * entry->dir.scale, iconSize);
+    return QSize(result, result);
 }
 
-static bool isSymbolic(const QString& iconName)
+QList<QSize> CuteCosmicIconEngine::availableSizes(QIcon::Mode mode, QIcon::State state)
 {
-    return iconName.endsWith("-symbolic"_L1)
-        || iconName.endsWith("-symbolic-rtl"_L1);
-}
+    Q_UNUSED(mode);
+    Q_UNUSED(state);
 
-static bool isOnKdeStylesheetElement(const QXmlStreamReader& reader)
-{
-    return reader.isStartElement()
-        && reader.name() == "style"_L1
-        && reader.attributes().value("type"_L1) == "text/css"_L1
-        && reader.attributes().value("id"_L1) == "current-color-scheme"_L1;
-}
+    ensureLoaded();
 
-static bool preprocessSvgIcon(QIODevice* in, QIODevice* out, const QString& iconCss)
-{
-    QXmlStreamReader reader { in };
-    QXmlStreamWriter writer { out };
+    QList<QSize> sizes;
+    sizes.reserve(d_iconInfo->entries.size());
 
-    bool isKdeSymbolic = false;
+    // Fallback entries are left out, as they are never picked for rendering
+    for (const CuteCosmicIconEntry& entry : std::as_const(d_iconInfo->entries)) {
+        if (entry.dir.type == QIconDirInfo::Fallback) {
+            continue;
+        }
 
-    while (!reader.atEnd()) {
-        reader.readNext();
-        if (reader.error() != QXmlStreamReader::NoError) {
-            break;
+        // The same size often comes from several directories (e.g @2x ones)
+        QSize size { entry.dir.size, entry.dir.size };
+        if (size.isValid() && !sizes.contains(size)) {
+            sizes.append(size);
         }
+    }
+
+    return sizes;
+}
 
-        if (isOnKdeStylesheetElement(reader)) {
-            writer.writeStartElement("style");
-            writer.writeAttributes(reader.attributes());
-            writer.writeCharacters(iconCss);
-            writer.writeEndElement();
+void CuteCosmicIconEngine::paint(QPainter* painter, const QRect& rect, QIcon::Mode mode, QIcon::State state)
+{
+    Q_UNUSED(state);
 
-            while (reader.tokenType() != QXmlStreamReader::EndElement && reader.error() == QXmlStreamReader::NoError) {
-                reader.readNext();
-            }
-            isKdeSymbolic = true;
+    qreal scale = (painter->device()) ? painter->device()->devicePixelRatio() : qGuiApp->devicePixelRatio();
+
+    // In async mode don't block painting on rendering, but have whatever is
+    // being painted (most likely a widget) updated once the icon is ready.
+    // Until then, make do with the last pixmap this engine produced.
+    QObject* requester = nullptr;
+    if (d_renderer->isAsync() && painter->device()) {
+        if (painter->device()->devType() == QInternal::Widget) {
+            requester = dynamic_cast<QObject*>(painter->device());
         }
         else {
-            writer.writeCurrentToken(reader);
+            requester = dynamic_cast<QPaintDeviceWindow*>(painter->device());
         }
     }
 
-    return isKdeSymbolic;
+    QPixmap pixmap = renderPixmap(rect.size(), mode, scale, requester);
+    if (pixmap.isNull() && requester) {
+        pixmap = d_lastPixmap;
+    }
+
+    if (!pixmap.isNull()) {
+        painter->drawPixmap(rect, pixmap);
+    }
 }
 
-static void recolorIcon(QImage& image, const QColor& color)
+QPixmap CuteCosmicIconEngine::pixmap(const QSize& size, QIcon::Mode mode, QIcon::State state)
 {
-    QRgb c = color.rgba();
+    return scaledPixmap(size, mode, state, 1.0);
+}
 
-    for (int y = 0; y < image.height(); y++) {
-        QRgb* line = reinterpret_cast<QRgb*>(image.scanLine(y));
-        for (int x = 0; x < image.width(); x++) {
-            QRgb& rgb = line[x];
-            rgb = qRgba(qRed(c), qGreen(c), qBlue(c), qAlpha(rgb));
-        }
+QPixmap CuteCosmicIconEngine::scaledPixmap(const QSize& size, QIcon::Mode mode, QIcon::State state, qreal scale)
+{
+    Q_UNUSED(state);
+    return renderPixmap(size, mode, scale, nullptr);
+}
+
+void CuteCosmicIconEngine::prewarm(const QSize& size, QIcon::Mode mode, qreal scale)
+{
+    CuteCosmicIconRenderer::Request request;
+    if (renderRequest(size, mode, scale, &request)) {
+        d_renderer->renderAsync(request, nullptr);
     }
 }
 
-QPixmap CuteCosmicIconEngine::renderSvgIcon(const QString& path, const QSize& size, QIcon::Mode mode, QIcon::State state)
+bool CuteCosmicIconEngine::renderRequest(const QSize& size, QIcon::Mode mode, qreal scale, CuteCosmicIconRenderer::Request* request)
 {
-    Q_UNUSED(state);
+    ensureLoaded();
+
+    int iconSize = qMin(size.height(), size.width());
 
-    QPalette appPalette = QGuiApplication::palette();
+    const CuteCosmicIconEntry* entry = bestEntryForSize(iconSize, scale);
+    if (!entry) {
+        return false;
+    }
 
-    QString cacheKey;
-    QTextStream(&cacheKey) << "$cutecosmic|"_L1
-                           << path << "|"_L1
-                           << mode << "|"_L1
-                           << size.width() << "|"_L1
-                           << appPalette.cacheKey();
+    *request = CuteCosmicIconRenderer::Request {
+        entry->filename,
+        renderSize(entry, iconSize, scale),
+        scale,
+        mode,
+        isSymbolic(d_iconInfo->iconName)
+    };
+    return true;
+}
 
-    QPixmap result;
-    if (QPixmapCache::find(cacheKey, &result)) {
-        return result;
+QPixmap CuteCosmicIconEngine::renderPixmap(const QSize& size, QIcon::Mode mode, qreal scale, QObject* requester)
+{
+    ensureLoaded();
+
+    int iconSize = qMin(size.height(), size.width());
+
+    CuteCosmicIconProfile* profile = d_renderer->profile();
+    if (profile->isRecording()) {
+        profile->record(CuteCosmicIconProfile::Entry { d_iconName, iconSize, scale, mode });
     }
 
-    QFile file { path };
-    if (!file.open(QFile::ReadOnly)) {
-        return QPixmap();
+    LastRequest lastRequest {
+        true,
+        iconSize,
+        scale,
+        mode,
+        QGuiApplication::palette().cacheKey(),
+        d_renderer->iconCssHash()
+    };
+
+    if (d_lastRequest == lastRequest) {
+        return d_lastPixmap;
     }
 
-    QBuffer buffer;
-    if (!buffer.open(QBuffer::ReadWrite)) {
+    CuteCosmicIconRenderer::Request request;
+    if (!renderRequest(size, mode, scale, &request)) {
         return QPixmap();
     }
 
-    bool isKdeSymbolic = preprocessSvgIcon(&file, &buffer, d_colorManager->iconCss());
-    buffer.seek(0);
-
-    QImageReader reader { &buffer, "svg" };
-    reader.setScaledSize(size);
-
-    QImage image = reader.read().convertToFormat(QImage::Format_ARGB32);
-    if (isSymbolic(d_iconInfo.iconName) && !isKdeSymbolic) {
-        QColor tint = appPalette.color(QPalette::Active, QPalette::Text);
-        recolorIcon(image, tint);
+    QPixmap result = requester ? d_renderer->renderAsync(request, requester) : d_renderer->render(request);
+    if (!result.isNull()) {
+        // A no-op for pixmaps from the renderer, which already carry the
+        // ratio - but the style might not keep it for generated modes
+        result.setDevicePixelRatio(scale);
+        d_lastPixmap = result;
+        d_lastRequest = lastRequest;
     }
-
-    result = QGuiApplicationPrivate::instance()->applyQIconStyleHelper(mode, QPixmap::fromImage(image));
-    QPixmapCache::insert(cacheKey, result);
     return result;
 }
 
-static qreal directorySizeDistance(QIconDirInfo& dir, int size, qreal scale)
+void CuteCosmicIconEngine::ensureLoaded()
 {
-    // This is basically DirectorySizeDistance as listed in the XDG Icon Theme
-    // specification
-
-    const qreal scaledSize = size * scale;
-
-    if (dir.type == QIconDirInfo::Fixed) {
-        return qAbs(dir.size * dir.scale - scaledSize);
+    // The icon is only resolved once something needs it, as many icons are
+    // created for actions that are never shown. Like QIconLoaderEngine, pick
+    // up icon theme changes.
+    uint themeKey = CuteCosmicIconLookup::themeKey();
+    if (!d_iconInfo || d_themeKey != themeKey) {
+        d_themeKey = themeKey;
+        d_iconInfo = CuteCosmicIconLookup::instance()->lookup(d_iconName);
+        d_sizeMatches = {};
+        d_lastRequest = {};
     }
-    if (dir.type == QIconDirInfo::Scalable) {
-        if (scaledSize < dir.minSize * dir.scale) {
-            return dir.minSize * dir.scale - scaledSize;
-        }
-        else if (scaledSize > dir.maxSize * dir.scale) {
-            return scaledSize - dir.maxSize * dir.scale;
-        }
-        return 0;
+}
+
+const CuteCosmicIconEntry* CuteCosmicIconEngine::bestEntryForSize(int size, qreal scale)
+{
+    const auto& entries = d_iconInfo->entries;
+    if (entries.isEmpty()) {
+        return nullptr;
     }
-    if (dir.type == QIconDirInfo::Threshold) {
-        const qreal minScaledSize = (dir.size - dir.threshold) * dir.scale;
-        const qreal maxScaledSize = (dir.size + dir.threshold) * dir.scale;
 
-        if (scaledSize < minScaledSize) {
-            return minScaledSize - scaledSize;
-        }
-        else if (scaledSize > maxScaledSize) {
-            return scaledSize - maxScaledSize;
+    // The same few sizes are requested over and over again while painting
+    for (const SizeMatch& match : d_sizeMatches) {
+        if (match.size == size && match.scale == scale) {
+            return (match.entry >= 0) ? &entries[match.entry] : nullptr;
         }
-        return 0;
     }
-    return std::numeric_limits<qreal>::max();
-}
 
-QString CuteCosmicIconEngine::bestIconFileForSize(int size, qreal scale)
-{
+    const qreal scaledSize = size * scale;
+
     qreal minDistance = std::numeric_limits<qreal>::max();
-    QString minDistancePath;
+    qsizetype minDistanceEntry = -1;
 
-    for (const auto& entry : std::as_const(d_iconInfo.entries)) {
-        qreal distance = directorySizeDistance(entry->dir, size, scale);
+    for (qsizetype i = 0; i < entries.size(); i++) {
+        qreal distance = entries[i].sizeDistance(scaledSize);
         if (qFuzzyIsNull(distance)) {
             // XDG spec says we have to use the first exactly matching icon
-            return entry->filename;
+            minDistanceEntry = i;
+            break;
         }
 
         if (distance < minDistance) {
             minDistance = distance;
-            minDistancePath = entry->filename;
+            minDistanceEntry = i;
         }
     }
-    return minDistancePath;
+
+    d_sizeMatches[d_nextSizeMatch] = SizeMatch { size, scale, minDistanceEntry };
+    d_nextSizeMatch = (d_nextSizeMatch + 1) % d_sizeMatches.size();
+
+    return (minDistanceEntry >= 0) ? &entries[minDistanceEntry] : nullptr;
+}
+
+QSize CuteCosmicIconEngine::renderSize(const CuteCosmicIconEntry* entry, int size, qreal scale)
+{
+    // Raster files are never scaled up, so asking for them at larger sizes
+    // would only cache the same pixels again under another key
+    QSize result = QSize(size, size) * scale;
+    if (!cuteCosmicIsSvgFile(entry->filename) && entry->dir.type != QIconDirInfo::Fallback) {
+        int nativeSize = entry->dir.size * entry->dir.scale;
+        result = result.boundedTo(QSize(nativeSize, nativeSize));
+    }
+    return result;
 }
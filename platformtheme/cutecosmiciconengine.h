@@ -16,16 +16,20 @@
  */
 #pragma once
 
+#include "cutecosmiciconrenderer.h"
+
 #include <QIconEngine>
 
-#include <QtGui/private/qiconloader_p.h>
+#include <array>
+#include <memory>
 
-class CuteCosmicColorManager;
+struct CuteCosmicIconEntry;
+struct CuteCosmicIconInfo;
 
 class CuteCosmicIconEngine : public QIconEngine
 {
 public:
-    CuteCosmicIconEngine(const QString& iconName, CuteCosmicColorManager* colorManager);
+    CuteCosmicIconEngine(const QString& iconName, CuteCosmicIconRenderer* renderer);
 
     QIconEngine* clone() const override;
 
@@ -33,15 +37,61 @@ public:
     QString iconName() override;
     bool isNull() override;
 
+    QSize actualSize(const QSize& size, QIcon::Mode mode, QIcon::State state) override;
+    QList<QSize> availableSizes(QIcon::Mode mode, QIcon::State state) override;
+
     void paint(QPainter* painter, const QRect& rect, QIcon::Mode mode, QIcon::State state) override;
     QPixmap pixmap(const QSize& size, QIcon::Mode mode, QIcon::State state) override;
     QPixmap scaledPixmap(const QSize& size, QIcon::Mode mode, QIcon::State state, qreal scale) override;
 
+    void prewarm(const QSize& size, QIcon::Mode mode, qreal scale);
+
+    // What the renderer needs to render the icon, if it was found
+    bool renderRequest(const QSize& size, QIcon::Mode mode, qreal scale, CuteCosmicIconRenderer::Request* request);
+
 private:
-    QPixmap renderSvgIcon(const QString& path, const QSize& size, QIcon::Mode mode, QIcon::State state);
+    QPixmap renderPixmap(const QSize& size, QIcon::Mode mode, qreal scale, QObject* requester);
+
+    void ensureLoaded();
+    const CuteCosmicIconEntry* bestEntryForSize(int size, qreal scale);
+    static QSize renderSize(const CuteCosmicIconEntry* entry, int size, qreal scale);
+
+    // Recently requested sizes and their best matching entry index
+    struct SizeMatch
+    {
+        int size;
+        qreal scale;
+        qsizetype entry;
+    };
+
+    // What the last pixmap was rendered for, so that painting the same icon
+    // over and over doesn't even need to go through the renderer
+    struct LastRequest
+    {
+        bool valid;
+        int size;
+        qreal scale;
+        QIcon::Mode mode;
+        qint64 paletteKey;
+        size_t iconCssHash;
 
-    QString bestIconFileForSize(int size, qreal scale);
+        friend bool operator==(const LastRequest& lhs, const LastRequest& rhs)
+        {
+            return lhs.valid == rhs.valid
+                && lhs.size == rhs.size
+                && lhs.scale == rhs.scale
+                && lhs.mode == rhs.mode
+                && lhs.paletteKey == rhs.paletteKey
+                && lhs.iconCssHash == rhs.iconCssHash;
+        }
+    };
 
-    QThemeIconInfo d_iconInfo;
-    CuteCosmicColorManager* d_colorManager;
+    QString d_iconName;
+    uint d_themeKey;
+    std::shared_ptr<const CuteCosmicIconInfo> d_iconInfo;
+    std::array<SizeMatch, 4> d_sizeMatches;
+    size_t d_nextSizeMatch;
+    QPixmap d_lastPixmap;
+    LastRequest d_lastRequest;
+    CuteCosmicIconRenderer* d_renderer;
 };
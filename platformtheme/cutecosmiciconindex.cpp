@@ -0,0 +1,556 @@
+/*
+ * This file is part of CuteCosmic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "cutecosmiciconindex.h"
+#include "cutecosmicpaths.h"
+#include "cutecosmicutils.h"
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QFileInfo>
+#include <QHash>
+#include <QSaveFile>
+#include <QSet>
+#include <QSettings>
+#include <QTimeZone>
+
+#include <array>
+
+#include <sys/file.h>
+
+using namespace Qt::StringLiterals;
+
+static constexpr quint32 INDEX_MAGIC = 0x58494343; // "CCIX"
+static constexpr quint32 INDEX_VERSION = 4;
+static constexpr quint32 EMPTY_BUCKET = 0xffffffff;
+
+// In the order QIconLoader prefers them within a directory
+static const std::array<QLatin1StringView, 2> EXTENSIONS { ".png"_L1, ".svg"_L1 };
+
+struct IndexHeader
+{
+    quint32 magic;
+    quint32 version;
+    quint64 fingerprint;
+    quint32 keyOffset;
+    quint32 keySize;
+    quint32 dirCount;
+    quint32 dirsOffset;
+    quint32 nameCount;
+    quint32 namesOffset;
+    quint32 bucketCount;
+    quint32 bucketsOffset;
+    quint32 entryCount;
+    quint32 entriesOffset;
+    quint32 stringsOffset;
+    quint32 stringsSize;
+};
+
+struct IndexDirectory
+{
+    quint32 pathOffset;
+    quint32 pathSize;
+    qint16 size;
+    qint16 minSize;
+    qint16 maxSize;
+    qint16 threshold;
+    qint16 scale;
+    quint16 type;
+};
+
+struct IndexName
+{
+    quint32 hash;
+    quint32 nameOffset;
+    quint32 nameSize;
+    quint32 firstEntry;
+    quint32 entryCount;
+};
+
+struct IndexEntry
+{
+    quint32 dir;
+    quint32 extension;
+};
+
+static_assert(sizeof(IndexHeader) == 64);
+static_assert(sizeof(IndexDirectory) == 20);
+static_assert(sizeof(IndexName) == 20);
+static_assert(sizeof(IndexEntry) == 8);
+
+namespace {
+
+struct ThemeScan
+{
+    // Icon directories of each theme, in lookup order
+    QList<QList<QIconDirInfo>> themes;
+    QCryptographicHash fingerprint { QCryptographicHash::Sha1 };
+    const std::atomic<bool>* cancelled;
+
+    bool isCancelled() const { return cancelled->load(std::memory_order_relaxed); }
+};
+
+}
+
+static quint32 hashName(QByteArrayView name)
+{
+    return static_cast<quint32>(cuteCosmicStableHash(name));
+}
+
+static void addToFingerprint(QCryptographicHash* hash, const QFileInfo& info)
+{
+    hash->addData(QFile::encodeName(info.filePath()));
+    hash->addData(QByteArray::number(info.lastModified(QTimeZone::UTC).toMSecsSinceEpoch()));
+}
+
+static QIconDirInfo::Type parseDirectoryType(const QString& type)
+{
+    if (type == "Fixed"_L1) {
+        return QIconDirInfo::Fixed;
+    }
+    else if (type == "Scalable"_L1) {
+        return QIconDirInfo::Scalable;
+    }
+    return QIconDirInfo::Threshold;
+}
+
+// Follows what QIconTheme and QIconLoader do: the first index.theme found
+// describes the theme, the directories it lists are looked for in every
+// search path, and parent themes are searched depth first.
+static void scanTheme(const QString& name, const CuteCosmicIconIndex::Themes& themes, QSet<QString>* visited, ThemeScan* scan)
+{
+    if (name.isEmpty() || visited->contains(name) || scan->isCancelled()) {
+        return;
+    }
+    visited->insert(name);
+
+    QStringList contentDirs;
+    QString indexFile;
+
+    for (const QString& searchPath : themes.searchPaths) {
+        QString themeDir = searchPath + u'/' + name;
+        if (!QFileInfo(themeDir).isDir()) {
+            continue;
+        }
+
+        contentDirs.append(themeDir);
+        if (indexFile.isEmpty() && QFileInfo::exists(themeDir + "/index.theme"_L1)) {
+            indexFile = themeDir + "/index.theme"_L1;
+        }
+    }
+
+    if (indexFile.isEmpty()) {
+        return;
+    }
+
+    addToFingerprint(&scan->fingerprint, QFileInfo(indexFile));
+
+    QSettings settings { indexFile, QSettings::IniFormat };
+    QList<QIconDirInfo> subDirs;
+
+    // Directories are kept in the order the theme lists them, as the first
+    // exact match for a size is the one that is used
+    QStringList dirKeys = settings.value("Icon Theme/Directories"_L1).toStringList();
+    dirKeys += settings.value("Icon Theme/ScaledDirectories"_L1).toStringList();
+    dirKeys.removeAll(QString());
+    dirKeys.removeDuplicates();
+
+    for (const QString& dirKey : std::as_const(dirKeys)) {
+        int size = settings.value(dirKey + "/Size"_L1).toInt();
+        if (size <= 0) {
+            continue;
+        }
+
+        QIconDirInfo info { dirKey };
+        info.size = static_cast<short>(size);
+        info.minSize = static_cast<short>(settings.value(dirKey + "/MinSize"_L1, size).toInt());
+        info.maxSize = static_cast<short>(settings.value(dirKey + "/MaxSize"_L1, size).toInt());
+        info.threshold = static_cast<short>(settings.value(dirKey + "/Threshold"_L1, 2).toInt());
+        info.scale = static_cast<short>(settings.value(dirKey + "/Scale"_L1, 1).toInt());
+        info.type = parseDirectoryType(settings.value(dirKey + "/Type"_L1).toString());
+        subDirs.append(info);
+    }
+
+    QList<QIconDirInfo> dirs;
+    for (const QString& contentDir : std::as_const(contentDirs)) {
+        for (const QIconDirInfo& subDir : std::as_const(subDirs)) {
+            QFileInfo dirInfo { contentDir + u'/' + subDir.path };
+            if (!dirInfo.isDir()) {
+                continue;
+            }
+
+            addToFingerprint(&scan->fingerprint, dirInfo);
+
+            QIconDirInfo dir = subDir;
+            dir.path = dirInfo.filePath();
+            dirs.append(dir);
+        }
+    }
+    scan->themes.append(dirs);
+
+    // Same as QIconTheme::parents(): the fallback theme always comes after
+    // the inherited ones, and hicolor always comes last
+    QStringList parents = settings.value("Icon Theme/Inherits"_L1).toStringList();
+    parents.removeAll(QString());
+    if (!themes.fallbackName.isEmpty()) {
+        parents.append(themes.fallbackName);
+    }
+    parents.removeAll("hicolor"_L1);
+    parents.append("hicolor"_L1);
+
+    for (const QString& parent : std::as_const(parents)) {
+        scanTheme(parent, themes, visited, scan);
+    }
+}
+
+static void scanThemes(const CuteCosmicIconIndex::Themes& themes, ThemeScan* scan)
+{
+    scan->fingerprint.addData(themes.key().toUtf8());
+
+    QSet<QString> visited;
+    scanTheme(themes.name, themes, &visited, scan);
+}
+
+static quint64 takeFingerprint(ThemeScan* scan)
+{
+    quint64 fingerprint;
+    memcpy(&fingerprint, scan->fingerprint.resultView().data(), sizeof(fingerprint));
+    return fingerprint;
+}
+
+QString CuteCosmicIconIndex::Themes::key() const
+{
+    return name + u'\n' + fallbackName + u'\n' + searchPaths.join(u'\n');
+}
+
+QString CuteCosmicIconIndex::indexPath(const Themes& themes)
+{
+    QString directory = cuteCosmicCacheDirectory();
+    if (directory.isEmpty()) {
+        return QString();
+    }
+
+    directory += "/icon-index"_L1;
+    if (!QDir().mkpath(directory)) {
+        return QString();
+    }
+
+    QByteArray hash = QCryptographicHash::hash(themes.key().toUtf8(), QCryptographicHash::Sha1).toHex();
+    return directory + u'/' + QString::fromLatin1(hash.first(16)) + ".index"_L1;
+}
+
+quint64 CuteCosmicIconIndex::fingerprint(const Themes& themes, const std::atomic<bool>& cancelled)
+{
+    ThemeScan scan;
+    scan.cancelled = &cancelled;
+    scanThemes(themes, &scan);
+    return scan.isCancelled() ? 0 : takeFingerprint(&scan);
+}
+
+bool CuteCosmicIconIndex::build(const QString& path, const Themes& themes, const std::atomic<bool>& cancelled)
+{
+    // Processes that noticed the same change all want to rebuild the index,
+    // the lock makes all but the first one find it up to date instead
+    QFile lockFile { path + ".lock"_L1 };
+    if (!lockFile.open(QIODevice::WriteOnly) || ::flock(lockFile.handle(), LOCK_EX) != 0) {
+        return false;
+    }
+
+    ThemeScan scan;
+    scan.cancelled = &cancelled;
+    scanThemes(themes, &scan);
+    if (scan.isCancelled()) {
+        return false;
+    }
+
+    quint64 fingerprint = takeFingerprint(&scan);
+    if (std::unique_ptr<CuteCosmicIconIndex> existing = open(path, themes)) {
+        if (existing->fingerprint() == fingerprint) {
+            return true;
+        }
+    }
+
+    QList<QIconDirInfo> dirs;
+    QHash<QString, QList<IndexEntry>> names;
+
+    for (const QList<QIconDirInfo>& themeDirs : std::as_const(scan.themes)) {
+        // Only the first theme that has an icon provides its files
+        QHash<QString, QList<IndexEntry>> themeNames;
+
+        for (const QIconDirInfo& dir : themeDirs) {
+            if (scan.isCancelled()) {
+                return false;
+            }
+
+            quint32 dirIndex = dirs.size();
+            dirs.append(dir);
+
+            const QStringList files = QDir(dir.path).entryList(QDir::Files | QDir::Readable, QDir::Unsorted);
+            for (const QString& file : files) {
+                for (quint32 extension = 0; extension < EXTENSIONS.size(); extension++) {
+                    if (!file.endsWith(EXTENSIONS[extension])) {
+                        continue;
+                    }
+
+                    QList<IndexEntry>& entries = themeNames[file.chopped(EXTENSIONS[extension].size())];
+                    IndexEntry entry { dirIndex, extension };
+
+                    // Like QIconLoader, only use the preferred file of a
+                    // directory that has the icon in both formats
+                    if (!entries.isEmpty() && entries.last().dir == dirIndex) {
+                        entries.last().extension = qMin(entries.last().extension, extension);
+                    }
+                    else {
+                        entries.append(entry);
+                    }
+                }
+            }
+        }
+
+        for (auto it = themeNames.cbegin(); it != themeNames.cend(); ++it) {
+            if (!names.contains(it.key())) {
+                names.insert(it.key(), it.value());
+            }
+        }
+    }
+
+    QByteArray strings;
+    auto addString = [&strings](const QString& string, quint32* offset, quint32* size) {
+        QByteArray utf8 = string.toUtf8();
+        *offset = strings.size();
+        *size = utf8.size();
+        strings += utf8;
+    };
+
+    IndexHeader header {};
+    header.magic = INDEX_MAGIC;
+    header.version = INDEX_VERSION;
+    header.fingerprint = fingerprint;
+    header.dirCount = dirs.size();
+    header.nameCount = names.size();
+    header.bucketCount = 1;
+    while (header.bucketCount < header.nameCount * 2) {
+        header.bucketCount *= 2;
+    }
+
+    addString(themes.key(), &header.keyOffset, &header.keySize);
+
+    QList<IndexDirectory> dirRecords;
+    dirRecords.reserve(dirs.size());
+    for (const QIconDirInfo& dir : std::as_const(dirs)) {
+        IndexDirectory record {};
+        addString(dir.path, &record.pathOffset, &record.pathSize);
+        record.size = dir.size;
+        record.minSize = dir.minSize;
+        record.maxSize = dir.maxSize;
+        record.threshold = dir.threshold;
+        record.scale = dir.scale;
+        record.type = dir.type;
+        dirRecords.append(record);
+    }
+
+    QList<IndexName> nameRecords;
+    QList<IndexEntry> entryRecords;
+    QList<quint32> buckets(header.bucketCount, EMPTY_BUCKET);
+    nameRecords.reserve(names.size());
+
+    for (auto it = names.cbegin(); it != names.cend(); ++it) {
+        IndexName record {};
+        addString(it.key(), &record.nameOffset, &record.nameSize);
+        record.hash = hashName(QByteArrayView(strings).sliced(record.nameOffset, record.nameSize));
+        record.firstEntry = entryRecords.size();
+        record.entryCount = it.value().size();
+        entryRecords += it.value();
+
+        quint32 bucket = record.hash & (header.bucketCount - 1);
+        while (buckets[bucket] != EMPTY_BUCKET) {
+            bucket = (bucket + 1) & (header.bucketCount - 1);
+        }
+        buckets[bucket] = nameRecords.size();
+        nameRecords.append(record);
+    }
+
+    header.entryCount = entryRecords.size();
+    header.dirsOffset = sizeof(IndexHeader);
+    header.namesOffset = header.dirsOffset + sizeof(IndexDirectory) * dirRecords.size();
+    header.bucketsOffset = header.namesOffset + sizeof(IndexName) * nameRecords.size();
+    header.entriesOffset = header.bucketsOffset + sizeof(quint32) * buckets.size();
+    header.stringsOffset = header.entriesOffset + sizeof(IndexEntry) * entryRecords.size();
+    header.stringsSize = strings.size();
+
+    QByteArray contents;
+    contents.reserve(header.stringsOffset + header.stringsSize);
+    contents.append(reinterpret_cast<const char*>(&header), sizeof(IndexHeader));
+    contents.append(reinterpret_cast<const char*>(dirRecords.constData()), sizeof(IndexDirectory) * dirRecords.size());
+    contents.append(reinterpret_cast<const char*>(nameRecords.constData()), sizeof(IndexName) * nameRecords.size());
+    contents.append(reinterpret_cast<const char*>(buckets.constData()), sizeof(quint32) * buckets.size());
+    contents.append(reinterpret_cast<const char*>(entryRecords.constData()), sizeof(IndexEntry) * entryRecords.size());
+    contents.append(strings);
+
+    // Processes that have the old index mapped keep using it until they
+    // notice the new one
+    QSaveFile file { path };
+    if (!file.open(QIODevice::WriteOnly) || file.write(contents) != contents.size()) {
+        return false;
+    }
+    return file.commit();
+}
+
+static bool isWithin(qint64 size, quint32 offset, qint64 length)
+{
+    return qint64(offset) + length <= size;
+}
+
+std::unique_ptr<CuteCosmicIconIndex> CuteCosmicIconIndex::open(const QString& path, const Themes& themes)
+{
+    std::unique_ptr<CuteCosmicIconIndex> index { new CuteCosmicIconIndex() };
+
+    index->d_file.setFileName(path);
+    if (!index->d_file.open(QIODevice::ReadOnly)) {
+        return nullptr;
+    }
+
+    index->d_size = index->d_file.size();
+    if (index->d_size < qint64(sizeof(IndexHeader))) {
+        return nullptr;
+    }
+
+    index->d_data = index->d_file.map(0, index->d_size);
+    if (!index->d_data) {
+        return nullptr;
+    }
+
+    IndexHeader header;
+    memcpy(&header, index->d_data, sizeof(IndexHeader));
+
+    const qint64 size = index->d_size;
+    bool valid = header.magic == INDEX_MAGIC
+        && header.version == INDEX_VERSION
+        && header.bucketCount > 0
+        && (header.bucketCount & (header.bucketCount - 1)) == 0
+        && isWithin(size, header.dirsOffset, qint64(sizeof(IndexDirectory)) * header.dirCount)
+        && isWithin(size, header.namesOffset, qint64(sizeof(IndexName)) * header.nameCount)
+        && isWithin(size, header.bucketsOffset, qint64(sizeof(quint32)) * header.bucketCount)
+        && isWithin(size, header.entriesOffset, qint64(sizeof(IndexEntry)) * header.entryCount)
+        && isWithin(size, header.stringsOffset, header.stringsSize)
+        && isWithin(header.stringsSize, header.keyOffset, header.keySize);
+
+    if (!valid) {
+        return nullptr;
+    }
+
+    const char* strings = reinterpret_cast<const char*>(index->d_data + header.stringsOffset);
+    if (QByteArrayView(strings + header.keyOffset, header.keySize) != themes.key().toUtf8()) {
+        return nullptr;
+    }
+
+    const auto* dirs = reinterpret_cast<const IndexDirectory*>(index->d_data + header.dirsOffset);
+    index->d_dirs.reserve(header.dirCount);
+
+    for (quint32 i = 0; i < header.dirCount; i++) {
+        const IndexDirectory& record = dirs[i];
+        if (!isWithin(header.stringsSize, record.pathOffset, record.pathSize) || record.type > QIconDirInfo::Fallback) {
+            return nullptr;
+        }
+
+        QIconDirInfo dir { QString::fromUtf8(strings + record.pathOffset, record.pathSize) };
+        dir.size = record.size;
+        dir.minSize = record.minSize;
+        dir.maxSize = record.maxSize;
+        dir.threshold = record.threshold;
+        dir.scale = record.scale;
+        dir.type = static_cast<QIconDirInfo::Type>(record.type);
+        index->d_dirs.append(dir);
+    }
+
+    index->d_fingerprint = header.fingerprint;
+    return index;
+}
+
+bool CuteCosmicIconIndex::contains(const QString& iconName) const
+{
+    quint32 firstEntry;
+    quint32 entryCount;
+    return findName(iconName.toUtf8(), &firstEntry, &entryCount) && entryCount > 0;
+}
+
+QList<CuteCosmicIconIndex::File> CuteCosmicIconIndex::find(const QString& iconName) const
+{
+    QList<File> files;
+
+    quint32 firstEntry;
+    quint32 entryCount;
+    if (!findName(iconName.toUtf8(), &firstEntry, &entryCount)) {
+        return files;
+    }
+
+    IndexHeader header;
+    memcpy(&header, d_data, sizeof(IndexHeader));
+
+    const auto* entries = reinterpret_cast<const IndexEntry*>(d_data + header.entriesOffset);
+
+    files.reserve(entryCount);
+    for (quint32 i = 0; i < entryCount; i++) {
+        const IndexEntry& entry = entries[firstEntry + i];
+        if (entry.dir >= quint32(d_dirs.size()) || entry.extension >= EXTENSIONS.size()) {
+            continue;
+        }
+
+        const QIconDirInfo& dir = d_dirs[entry.dir];
+        files.append(File { dir.path + u'/' + iconName + EXTENSIONS[entry.extension], dir });
+    }
+
+    return files;
+}
+
+bool CuteCosmicIconIndex::findName(QByteArrayView name, quint32* firstEntry, quint32* entryCount) const
+{
+    IndexHeader header;
+    memcpy(&header, d_data, sizeof(IndexHeader));
+
+    const auto* names = reinterpret_cast<const IndexName*>(d_data + header.namesOffset);
+    const auto* buckets = reinterpret_cast<const quint32*>(d_data + header.bucketsOffset);
+    const char* strings = reinterpret_cast<const char*>(d_data + header.stringsOffset);
+
+    quint32 hash = hashName(name);
+    quint32 mask = header.bucketCount - 1;
+
+    for (quint32 probe = 0, bucket = hash & mask; probe < header.bucketCount; probe++, bucket = (bucket + 1) & mask) {
+        quint32 nameIndex = buckets[bucket];
+        if (nameIndex == EMPTY_BUCKET || nameIndex >= header.nameCount) {
+            return false;
+        }
+
+        const IndexName& record = names[nameIndex];
+        if (record.hash != hash
+            || record.nameSize != quint32(name.size())
+            || !isWithin(header.stringsSize, record.nameOffset, record.nameSize)
+            || QByteArrayView(strings + record.nameOffset, record.nameSize) != name) {
+            continue;
+        }
+
+        if (!isWithin(header.entryCount, record.firstEntry, record.entryCount)) {
+            return false;
+        }
+
+        *firstEntry = record.firstEntry;
+        *entryCount = record.entryCount;
+        return true;
+    }
+
+    return false;
+}
@@ -0,0 +1,82 @@
+/*
+ * This file is part of CuteCosmic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <QFile>
+#include <QList>
+#include <QString>
+#include <QStringList>
+
+#include <QtGui/private/qiconloader_p.h>
+
+#include <atomic>
+#include <memory>
+
+/*
+ * Precompiled index of the icon files in an icon theme and the themes it
+ * inherits from, so that icons can be resolved without probing the file
+ * system the way QIconLoader does. The index is stored in the cache
+ * directory, and memory mapped by every process using the same themes.
+ *
+ * Each index records a fingerprint of the index.theme files and icon
+ * directory modification times it was built from. Checking the fingerprint
+ * and rebuilding the index is slow, and meant to be done in the background
+ * while the previous index stays in use. Both give up as soon as the given
+ * flag is set. Rebuilds are serialized between processes through a lock
+ * file next to the index.
+ */
+class CuteCosmicIconIndex
+{
+public:
+    struct Themes
+    {
+        QString name;
+        QString fallbackName;
+        QStringList searchPaths;
+
+        QString key() const;
+    };
+
+    struct File
+    {
+        QString filename;
+        QIconDirInfo dir;
+    };
+
+    static QString indexPath(const Themes& themes);
+
+    static std::unique_ptr<CuteCosmicIconIndex> open(const QString& path, const Themes& themes);
+    static bool build(const QString& path, const Themes& themes, const std::atomic<bool>& cancelled);
+    static quint64 fingerprint(const Themes& themes, const std::atomic<bool>& cancelled);
+
+    quint64 fingerprint() const { return d_fingerprint; }
+
+    bool contains(const QString& iconName) const;
+    QList<File> find(const QString& iconName) const;
+
+private:
+    CuteCosmicIconIndex() = default;
+
+    bool findName(QByteArrayView name, quint32* firstEntry, quint32* entryCount) const;
+
+    QFile d_file;
+    const uchar* d_data = nullptr;
+    qint64 d_size = 0;
+    quint64 d_fingerprint = 0;
+
+    QList<QIconDirInfo> d_dirs;
+};
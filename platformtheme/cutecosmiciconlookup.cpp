@@ -0,0 +1,231 @@
+/*
+ * This file is part of CuteCosmic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "cutecosmiciconlookup.h"
+#include "cutecosmiciconindex.h"
+
+#include <QCoreApplication>
+#include <QIcon>
+
+#include <limits>
+
+Q_GLOBAL_STATIC(CuteCosmicIconLookup, s_iconLookup)
+
+qreal CuteCosmicIconEntry::sizeDistance(qreal scaledSize) const
+{
+    // This is basically DirectorySizeDistance as listed in the XDG Icon Theme
+    // specification
+    if (maxScaledSize < minScaledSize) {
+        return std::numeric_limits<qreal>::max();
+    }
+
+    if (scaledSize < minScaledSize) {
+        return minScaledSize - scaledSize;
+    }
+    else if (scaledSize > maxScaledSize) {
+        return scaledSize - maxScaledSize;
+    }
+    return 0;
+}
+
+static CuteCosmicIconEntry makeIconEntry(const QString& filename, const QIconDirInfo& dir)
+{
+    int minSize = 0;
+    int maxSize = -1;
+
+    switch (dir.type) {
+    case QIconDirInfo::Fixed:
+        minSize = maxSize = dir.size;
+        break;
+    case QIconDirInfo::Scalable:
+        minSize = dir.minSize;
+        maxSize = dir.maxSize;
+        break;
+    case QIconDirInfo::Threshold:
+        minSize = dir.size - dir.threshold;
+        maxSize = dir.size + dir.threshold;
+        break;
+    default:
+        break;
+    }
+
+    return CuteCosmicIconEntry {
+        filename,
+        dir,
+        minSize * dir.scale,
+        maxSize * dir.scale
+    };
+}
+
+CuteCosmicIconLookup::CuteCosmicIconLookup()
+    : d_themeKey(themeKey())
+    , d_indexGeneration(0)
+    , d_indexCancelled(std::make_shared<std::atomic<bool>>(false))
+{
+    // A rebuild that is still going on when the application quits is
+    // abandoned, the next process to use the themes will do it again
+    d_indexPool.setMaxThreadCount(1);
+    if (QCoreApplication* app = QCoreApplication::instance()) {
+        QObject::connect(app, &QCoreApplication::aboutToQuit, app, [cancelled = d_indexCancelled]() {
+            cancelled->store(true);
+        });
+    }
+
+    loadIndex();
+}
+
+CuteCosmicIconLookup::~CuteCosmicIconLookup()
+{
+    d_indexCancelled->store(true);
+    d_indexPool.waitForDone();
+}
+
+CuteCosmicIconLookup* CuteCosmicIconLookup::instance()
+{
+    return s_iconLookup();
+}
+
+bool CuteCosmicIconLookup::exists(const QString& iconName)
+{
+    {
+        QMutexLocker locker { &d_mutex };
+        checkThemeKey();
+
+        auto it = d_icons.constFind(iconName);
+        if (it != d_icons.constEnd()) {
+            return !(*it)->entries.isEmpty();
+        }
+
+        // Names that aren't in the index might still be found through the
+        // fallbacks of the icon loader
+        if (d_index && d_index->contains(iconName)) {
+            return true;
+        }
+    }
+
+    return !lookup(iconName)->entries.isEmpty();
+}
+
+std::shared_ptr<const CuteCosmicIconInfo> CuteCosmicIconLookup::lookup(const QString& iconName)
+{
+    QMutexLocker locker { &d_mutex };
+    checkThemeKey();
+
+    auto it = d_icons.constFind(iconName);
+    if (it != d_icons.constEnd()) {
+        return *it;
+    }
+
+    auto info = std::make_shared<CuteCosmicIconInfo>();
+
+    // Names that aren't in the index still go through the icon loader, which
+    // also handles the fallbacks for them
+    QList<CuteCosmicIconIndex::File> files;
+    if (d_index) {
+        files = d_index->find(iconName);
+    }
+
+    if (!files.isEmpty()) {
+        info->iconName = iconName;
+        info->entries.reserve(files.size());
+
+        for (const CuteCosmicIconIndex::File& file : std::as_const(files)) {
+            info->entries.append(makeIconEntry(file.filename, file.dir));
+        }
+    }
+    else {
+        QThemeIconInfo themeInfo = QIconLoader::instance()->loadIcon(iconName);
+
+        info->iconName = themeInfo.iconName;
+        info->entries.reserve(themeInfo.entries.size());
+
+        for (const auto& entry : std::as_const(themeInfo.entries)) {
+            info->entries.append(makeIconEntry(entry->filename, entry->dir));
+        }
+    }
+
+    d_icons.insert(iconName, info);
+    return info;
+}
+
+void CuteCosmicIconLookup::checkThemeKey()
+{
+    uint currentThemeKey = themeKey();
+    if (d_themeKey != currentThemeKey) {
+        d_icons.clear();
+        d_themeKey = currentThemeKey;
+        loadIndex();
+    }
+}
+
+void CuteCosmicIconLookup::loadIndex()
+{
+    d_index.reset();
+    quint64 generation = ++d_indexGeneration;
+
+    if (qEnvironmentVariableIsSet("CUTECOSMIC_DISABLE_DISK_CACHE")) {
+        return;
+    }
+
+    CuteCosmicIconIndex::Themes themes {
+        QIcon::themeName(),
+        QIcon::fallbackThemeName(),
+        QIcon::themeSearchPaths()
+    };
+
+    QString path = CuteCosmicIconIndex::indexPath(themes);
+    if (path.isEmpty()) {
+        return;
+    }
+
+    d_index = CuteCosmicIconIndex::open(path, themes);
+    quint64 fingerprint = d_index ? d_index->fingerprint() : 0;
+
+    // Checking whether the index is up to date means reading the index.theme
+    // files and going through every icon directory, so it is done in the
+    // background while the existing index (if any) is used. Checks for older
+    // theme changes that haven't started yet are pointless now.
+    d_indexPool.clear();
+    d_indexPool.start([themes, path, generation, fingerprint, cancelled = d_indexCancelled]() {
+        updateIndex(themes, path, generation, fingerprint, *cancelled);
+    });
+}
+
+void CuteCosmicIconLookup::updateIndex(const CuteCosmicIconIndex::Themes& themes, const QString& path, quint64 generation, quint64 fingerprint, const std::atomic<bool>& cancelled)
+{
+    if (fingerprint != 0 && CuteCosmicIconIndex::fingerprint(themes, cancelled) == fingerprint) {
+        return;
+    }
+
+    if (cancelled.load() || !CuteCosmicIconIndex::build(path, themes, cancelled)) {
+        return;
+    }
+
+    std::shared_ptr<CuteCosmicIconIndex> index = CuteCosmicIconIndex::open(path, themes);
+
+    // The lookup waits for this to finish before it goes away, and nothing
+    // is published to it once it started to
+    CuteCosmicIconLookup* lookup = instance();
+    if (!index || !lookup || cancelled.load()) {
+        return;
+    }
+
+    QMutexLocker locker { &lookup->d_mutex };
+    if (generation == lookup->d_indexGeneration) {
+        lookup->d_index = std::move(index);
+        lookup->d_icons.clear();
+    }
+}
@@ -0,0 +1,90 @@
+/*
+ * This file is part of CuteCosmic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "cutecosmiciconindex.h"
+
+#include <QHash>
+#include <QMutex>
+#include <QString>
+#include <QThreadPool>
+
+#include <QtGui/private/qiconloader_p.h>
+
+#include <atomic>
+#include <memory>
+
+struct CuteCosmicIconEntry
+{
+    QString filename;
+    QIconDirInfo dir;
+
+    // Range of sizes in device pixels that the entry is an exact match for,
+    // as per DirectoryMatchesSize in the XDG Icon Theme specification. Empty
+    // if the entry should never match.
+    int minScaledSize;
+    int maxScaledSize;
+
+    qreal sizeDistance(qreal scaledSize) const;
+};
+
+struct CuteCosmicIconInfo
+{
+    QString iconName;
+    QList<CuteCosmicIconEntry> entries;
+};
+
+/*
+ * Process wide table of resolved theme icons, so that each icon name is looked
+ * up in the icon theme only once no matter how many icon engines are created
+ * for it. Names that can't be found are remembered as well. The table is
+ * flushed whenever Qt's icon loader notices an icon theme change.
+ *
+ * Names are resolved through the precompiled icon theme index when there is
+ * one, and through QIconLoader otherwise. Unless the disk cache is disabled,
+ * the index is checked and rebuilt on a background thread of its own whenever
+ * the icon theme changes. That work is abandoned when the application quits.
+ */
+class CuteCosmicIconLookup
+{
+public:
+    CuteCosmicIconLookup();
+    ~CuteCosmicIconLookup();
+
+    static CuteCosmicIconLookup* instance();
+
+    static uint themeKey() { return QIconLoader::instance()->themeKey(); }
+
+    // Whether the icon can be found, which is cheaper than looking it up
+    // when the icon theme index has it
+    bool exists(const QString& iconName);
+    std::shared_ptr<const CuteCosmicIconInfo> lookup(const QString& iconName);
+
+private:
+    void checkThemeKey();
+    void loadIndex();
+    static void updateIndex(const CuteCosmicIconIndex::Themes& themes, const QString& path, quint64 generation, quint64 fingerprint, const std::atomic<bool>& cancelled);
+
+    QMutex d_mutex;
+    uint d_themeKey;
+    QHash<QString, std::shared_ptr<const CuteCosmicIconInfo>> d_icons;
+
+    std::shared_ptr<CuteCosmicIconIndex> d_index;
+    quint64 d_indexGeneration;
+    std::shared_ptr<std::atomic<bool>> d_indexCancelled;
+    QThreadPool d_indexPool;
+};
@@ -0,0 +1,141 @@
+/*
+ * This file is part of CuteCosmic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "cutecosmiciconprofile.h"
+#include "cutecosmicpaths.h"
+
+#include <QCoreApplication>
+#include <QDir>
+#include <QFile>
+#include <QLoggingCategory>
+#include <QSaveFile>
+#include <QTextStream>
+#include <QTimer>
+
+using namespace Qt::StringLiterals;
+
+Q_DECLARE_LOGGING_CATEGORY(lcCuteCosmic)
+
+static constexpr int RECORDING_DURATION_MS = 10000;
+static constexpr qsizetype MAX_ENTRIES = 512;
+
+CuteCosmicIconProfile::CuteCosmicIconProfile(QObject* parent)
+    : QObject(parent)
+    , d_recording(false)
+    , d_prewarmedUsed(0)
+{
+    if (!qEnvironmentVariableIsSet("CUTECOSMIC_ICON_PROFILE")) {
+        return;
+    }
+
+    QString directory = cuteCosmicCacheDirectory();
+    QString appName = QCoreApplication::applicationName();
+    if (directory.isEmpty() || appName.isEmpty()) {
+        return;
+    }
+
+    directory += "/profiles"_L1;
+    if (!QDir().mkpath(directory)) {
+        return;
+    }
+
+    d_path = directory + u'/' + appName.replace(u'/', u'_') + ".profile"_L1;
+    d_recording = true;
+
+    // Applications that quit before the recording ends still get a profile
+    QTimer::singleShot(RECORDING_DURATION_MS, this, &CuteCosmicIconProfile::stopRecording);
+    connect(qApp, &QCoreApplication::aboutToQuit, this, &CuteCosmicIconProfile::stopRecording);
+}
+
+QList<CuteCosmicIconProfile::Entry> CuteCosmicIconProfile::takePrewarmEntries()
+{
+    QList<Entry> entries;
+
+    QFile file { d_path };
+    if (!isEnabled() || !file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        return entries;
+    }
+
+    QTextStream stream { &file };
+    QString line;
+
+    while (entries.size() < MAX_ENTRIES && stream.readLineInto(&line)) {
+        QStringList fields = line.split(u'\t');
+        if (fields.size() != 4) {
+            continue;
+        }
+
+        // The file is in the user's cache directory, so don't trust it
+        bool sizeOk, scaleOk, modeOk;
+        int size = fields[1].toInt(&sizeOk);
+        qreal scale = fields[2].toDouble(&scaleOk);
+        int mode = fields[3].toInt(&modeOk);
+
+        if (!sizeOk || size <= 0 || !scaleOk || scale <= 0
+            || !modeOk || mode < QIcon::Normal || mode > QIcon::Selected
+            || fields[0].isEmpty()) {
+            continue;
+        }
+
+        entries.append(Entry { fields[0], size, scale, static_cast<QIcon::Mode>(mode) });
+    }
+
+    d_prewarmed = QSet<Entry>(entries.cbegin(), entries.cend());
+    return entries;
+}
+
+void CuteCosmicIconProfile::record(const Entry& entry)
+{
+    if (!d_recording || d_recorded.size() >= MAX_ENTRIES || d_recorded.contains(entry)) {
+        return;
+    }
+
+    if (d_prewarmed.contains(entry)) {
+        d_prewarmedUsed++;
+    }
+    d_recorded.insert(entry);
+}
+
+void CuteCosmicIconProfile::stopRecording()
+{
+    if (!d_recording) {
+        return;
+    }
+    d_recording = false;
+
+    if (!d_prewarmed.isEmpty()) {
+        qCInfo(lcCuteCosmic(),
+            "%d of %lld prewarmed icons were used during startup",
+            d_prewarmedUsed,
+            static_cast<long long>(d_prewarmed.size()));
+    }
+
+    // Quitting before anything was painted shouldn't lose the last profile
+    QSaveFile file { d_path };
+    if (!d_recorded.isEmpty() && file.open(QIODevice::WriteOnly | QIODevice::Text)) {
+        QTextStream stream { &file };
+        for (const Entry& entry : std::as_const(d_recorded)) {
+            stream << entry.iconName << '\t' << entry.size << '\t' << entry.scale << '\t' << int(entry.mode) << '\n';
+        }
+        stream.flush();
+        file.commit();
+    }
+
+    d_recorded.clear();
+    d_prewarmed.clear();
+}
+
+#include "moc_cutecosmiciconprofile.cpp"
@@ -0,0 +1,73 @@
+/*
+ * This file is part of CuteCosmic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <QIcon>
+#include <QObject>
+#include <QSet>
+
+/*
+ * Records which themed icons an application requests during the first seconds
+ * after it starts, so that on its next start they can be rendered in the
+ * background before they are actually needed. Enabled by setting the
+ * CUTECOSMIC_ICON_PROFILE environment variable.
+ */
+class CuteCosmicIconProfile : public QObject
+{
+    Q_OBJECT
+
+public:
+    struct Entry
+    {
+        QString iconName;
+        int size;
+        qreal scale;
+        QIcon::Mode mode;
+
+        friend bool operator==(const Entry& lhs, const Entry& rhs)
+        {
+            return lhs.iconName == rhs.iconName
+                && lhs.size == rhs.size
+                && qFuzzyCompare(lhs.scale, rhs.scale)
+                && lhs.mode == rhs.mode;
+        }
+
+        friend size_t qHash(const Entry& entry, size_t seed = 0)
+        {
+            return qHashMulti(seed, entry.iconName, entry.size, int(entry.mode));
+        }
+    };
+
+    CuteCosmicIconProfile(QObject* parent = nullptr);
+
+    bool isEnabled() const { return !d_path.isEmpty(); }
+    bool isRecording() const { return d_recording; }
+
+    QList<Entry> takePrewarmEntries();
+    void record(const Entry& entry);
+
+private Q_SLOTS:
+    void stopRecording();
+
+private:
+    QString d_path;
+    bool d_recording;
+
+    QSet<Entry> d_recorded;
+    QSet<Entry> d_prewarmed;
+    int d_prewarmedUsed;
+};
@@ -0,0 +1,574 @@
+/*
+ * This file is part of CuteCosmic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "cutecosmiciconrenderer.h"
+#include "cutecosmiccolormanager.h"
+#include "cutecosmicicondiskcache.h"
+#include "cutecosmiciconengine.h"
+#include "cutecosmiciconlookup.h"
+#include "cutecosmiciconprofile.h"
+#include "cutecosmicrecolor.h"
+#include "cutecosmicsvgcache.h"
+#include "cutecosmicutils.h"
+
+#include <QtGui/private/qguiapplication_p.h>
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QFile>
+#include <QFileInfo>
+#include <QGuiApplication>
+#include <QImageReader>
+#include <QMetaMethod>
+#include <QPaintDeviceWindow>
+#include <QPalette>
+#include <QTimeZone>
+#include <QTimer>
+
+#include <utility>
+
+using namespace Qt::StringLiterals;
+
+static constexpr qsizetype MAX_MASK_CACHE_COST = 2 * 1024 * 1024;
+static constexpr qsizetype MAX_IMAGE_CACHE_COST = 4 * 1024 * 1024;
+
+// Icons rendered with the KDE stylesheet that are rendered again in advance
+// on theme changes, and how long the theme change may be held back for them
+static constexpr qsizetype MAX_STYLED_REQUESTS = 256;
+static constexpr int MAX_THEME_CHANGE_DELAY_MS = 250;
+
+CuteCosmicIconRenderer::CuteCosmicIconRenderer(CuteCosmicColorManager* colorManager, QObject* parent)
+    : QObject(parent)
+    , d_colorManager(colorManager)
+    , d_async(qEnvironmentVariableIsSet("CUTECOSMIC_ASYNC_ICONS"))
+    , d_failedThemeKey(0)
+    , d_iconCssHash(0)
+    , d_nextIconCssHash(0)
+    , d_iconCssHeld(false)
+    , d_themeChangeGeneration(0)
+    , d_themeChangeJobs(0)
+{
+    d_profile = new CuteCosmicIconProfile(this);
+    d_masks.setMaxCost(MAX_MASK_CACHE_COST);
+    d_images.setMaxCost(MAX_IMAGE_CACHE_COST);
+    d_styledRequests.setMaxCost(MAX_STYLED_REQUESTS);
+    d_threadPool.setObjectName("CuteCosmicIconRenderer"_L1);
+}
+
+CuteCosmicIconRenderer::~CuteCosmicIconRenderer()
+{
+    d_threadPool.clear();
+    d_threadPool.waitForDone();
+}
+
+QPixmap CuteCosmicIconRenderer::render(const Request& request)
+{
+    Job job = createJob(request);
+
+    QPixmap result;
+    if (findPixmap(job, &result)) {
+        return result;
+    }
+
+    return finishJob(job, renderImage(job));
+}
+
+void CuteCosmicIconRenderer::prewarm()
+{
+    if (!d_profile->isEnabled()) {
+        return;
+    }
+
+    // Icons can only be looked up once the application object is fully
+    // constructed. Lookups are cheap and must be done on the GUI thread, but
+    // the rendering itself happens in the thread pool.
+    QTimer::singleShot(0, this, [this]() {
+        const QList<CuteCosmicIconProfile::Entry> entries = d_profile->takePrewarmEntries();
+        for (const CuteCosmicIconProfile::Entry& entry : entries) {
+            CuteCosmicIconEngine engine { entry.iconName, this };
+            engine.prewarm(QSize(entry.size, entry.size), entry.mode, entry.scale);
+        }
+    });
+}
+
+void CuteCosmicIconRenderer::prepareThemeChange(const std::function<void()>& ready)
+{
+    // A theme change that is still being prepared is delivered right away
+    finishThemeChange(d_themeChangeGeneration);
+    quint64 generation = ++d_themeChangeGeneration;
+
+    // Renders might only have failed because of the previous theme
+    d_failedJobs.clear();
+
+    // The stylesheet has already been updated, so these are the jobs for the
+    // new theme. Keys for the old theme stay in the cache until they age out.
+    QString paintedIconCss = d_iconCss;
+    size_t paintedIconCssHash = d_iconCssHash;
+
+    QList<Job> jobs;
+    const QList<CuteCosmicIconKey> styledKeys = d_styledRequests.keys();
+    for (const CuteCosmicIconKey& key : styledKeys) {
+        Job job = createJob(*d_styledRequests.object(key));
+        if (!job.iconCss.isEmpty() && !d_cache.contains(job.cacheKey)) {
+            jobs.append(job);
+        }
+    }
+    d_styledRequests.clear();
+
+    d_themeChangeReady = ready;
+    d_themeChangeJobs = jobs.size();
+
+    if (jobs.isEmpty()) {
+        finishThemeChange(generation);
+        return;
+    }
+
+    // Qt keeps painting with the previous palette until the change is
+    // delivered, so icons painted meanwhile keep the matching stylesheet
+    d_nextIconCss = std::exchange(d_iconCss, paintedIconCss);
+    d_nextIconCssHash = std::exchange(d_iconCssHash, paintedIconCssHash);
+    d_iconCssHeld = true;
+
+    for (const Job& job : std::as_const(jobs)) {
+        d_threadPool.start([this, generation, job]() {
+            QImage image = renderImage(job);
+            QMetaObject::invokeMethod(this, [this, generation, job, image = std::move(image)]() mutable { themeChangeJobFinished(generation, job, std::move(image)); }, Qt::QueuedConnection);
+        });
+    }
+
+    // Don't hold the theme change back for too long if rendering is slow
+    QTimer::singleShot(MAX_THEME_CHANGE_DELAY_MS, this, [this, generation]() { finishThemeChange(generation); });
+}
+
+void CuteCosmicIconRenderer::themeChangeJobFinished(quint64 generation, const Job& job, QImage image)
+{
+    finishJob(job, std::move(image));
+
+    if (generation == d_themeChangeGeneration && --d_themeChangeJobs == 0) {
+        finishThemeChange(generation);
+    }
+}
+
+void CuteCosmicIconRenderer::finishThemeChange(quint64 generation)
+{
+    if (generation != d_themeChangeGeneration || !d_themeChangeReady) {
+        return;
+    }
+
+    std::function<void()> ready = std::move(d_themeChangeReady);
+    d_themeChangeReady = nullptr;
+
+    if (d_iconCssHeld) {
+        d_iconCss = std::move(d_nextIconCss);
+        d_iconCssHash = d_nextIconCssHash;
+        d_iconCssHeld = false;
+    }
+    ready();
+}
+
+void CuteCosmicIconRenderer::renderImageAsync(const QString& iconName, const QSize& size, QIcon::Mode mode, const std::function<void(const QImage&)>& done)
+{
+    // The icon lookup and the palette are GUI thread only, so resolve the
+    // request there - that is cheap, the rendering itself isn't
+    QMetaObject::invokeMethod(this, [this, iconName, size, mode, done]() { startImageJob(iconName, size, mode, done); }, Qt::QueuedConnection);
+}
+
+void CuteCosmicIconRenderer::startImageJob(const QString& iconName, const QSize& size, QIcon::Mode mode, const std::function<void(const QImage&)>& done)
+{
+    CuteCosmicIconEngine engine { iconName, this };
+
+    Request request;
+    if (!engine.renderRequest(size, mode, 1.0, &request)) {
+        done(QImage());
+        return;
+    }
+
+    Job job = createJob(request);
+
+    {
+        QMutexLocker locker { &d_imagesMutex };
+        if (QImage* image = d_images.object(job.cacheKey)) {
+            done(*image);
+            return;
+        }
+    }
+
+    d_threadPool.start([this, job, done]() {
+        QImage image = renderImage(job);
+
+        // Other modes are generated by the style, which only works with
+        // pixmaps on the GUI thread
+        if (job.isDerived() && !image.isNull()) {
+            QMetaObject::invokeMethod(this, [this, job, image, done]() {
+                QImage derived = finishJob(job, image).toImage();
+                insertImage(job.cacheKey, derived);
+                done(derived);
+            }, Qt::QueuedConnection);
+            return;
+        }
+
+        if (job.isMask() && !image.isNull()) {
+            image = cuteCosmicColorizeMask(image, job.tint.rgba());
+        }
+
+        insertImage(job.cacheKey, image);
+        done(image);
+    });
+}
+
+void CuteCosmicIconRenderer::insertImage(const CuteCosmicIconKey& key, const QImage& image)
+{
+    if (image.isNull()) {
+        return;
+    }
+
+    QMutexLocker locker { &d_imagesMutex };
+    d_images.insert(key, new QImage(image), qMax<qsizetype>(image.sizeInBytes(), 1));
+}
+
+static void updateRequester(QObject* requester)
+{
+    if (auto* window = qobject_cast<QPaintDeviceWindow*>(requester)) {
+        window->update();
+        return;
+    }
+
+    // QWidget::update() can't be called directly without linking to Qt
+    // Widgets, so it is looked up once and invoked through the meta-object
+    static const QMetaMethod widgetUpdate = [requester]() {
+        const QMetaObject* metaObject = requester->metaObject();
+        return metaObject->method(metaObject->indexOfSlot("update()"));
+    }();
+    widgetUpdate.invoke(requester);
+}
+
+QPixmap CuteCosmicIconRenderer::renderAsync(const Request& request, QObject* requester)
+{
+    Job job = createJob(request);
+
+    // Jobs are coalesced by the raster they render, so that requests for
+    // different modes of the same icon only render it once
+    CuteCosmicIconKey key = job.renderKey();
+
+    QPixmap result;
+    if (findPixmap(job, &result)) {
+        return result;
+    }
+
+    // Files might have been fixed or replaced along with the icon theme
+    uint themeKey = CuteCosmicIconLookup::themeKey();
+    if (d_failedThemeKey != themeKey) {
+        d_failedJobs.clear();
+        d_failedThemeKey = themeKey;
+    }
+
+    if (d_failedJobs.contains(key)) {
+        return result;
+    }
+
+    bool pending = d_pendingJobs.contains(key);
+
+    QList<QPointer<QObject>>& requesters = d_pendingJobs[key];
+    if (requester && !requesters.contains(requester)) {
+        requesters.append(requester);
+    }
+
+    if (pending) {
+        return result;
+    }
+
+    d_threadPool.start([this, job]() {
+        QImage image = renderImage(job);
+        QMetaObject::invokeMethod(this, [this, job, image = std::move(image)]() mutable { jobFinished(job, std::move(image)); }, Qt::QueuedConnection);
+    });
+
+    return result;
+}
+
+bool CuteCosmicIconRenderer::findPixmap(const Job& job, QPixmap* result)
+{
+    // Only the masks of symbolic icons are cached, colorizing them is cheap
+    if (job.isMask()) {
+        if (QImage* mask = d_masks.object(job.maskKey())) {
+            *result = finishJob(job, *mask);
+            return true;
+        }
+        return false;
+    }
+
+    if (d_cache.find(job.cacheKey, job.category, result)) {
+        rememberStyledJob(job);
+        return true;
+    }
+
+    // Other modes are derived from the raster if it was already rendered
+    if (job.isDerived()) {
+        QPixmap normal;
+        if (d_cache.find(job.normalKey, job.category, &normal)) {
+            *result = deriveMode(job, normal);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+size_t CuteCosmicIconRenderer::iconCssHash() const
+{
+    return d_iconCssHeld ? d_iconCssHash : d_colorManager->iconCssHash();
+}
+
+void CuteCosmicIconRenderer::updateIconCss()
+{
+    if (!d_iconCssHeld) {
+        d_iconCss = d_colorManager->iconCss();
+        d_iconCssHash = d_colorManager->iconCssHash();
+    }
+}
+
+void CuteCosmicIconRenderer::rememberStyledJob(const Job& job)
+{
+    if (job.iconCss.isEmpty()) {
+        return;
+    }
+
+    // Icons painted with the held stylesheet are being rendered with the next
+    // one already, and are remembered once those renders finish
+    if (d_iconCssHeld && job.normalKey.inputs == d_iconCssHash) {
+        return;
+    }
+
+    // Looking the request up also makes it the most recently used one
+    if (!d_styledRequests.object(job.renderKey())) {
+        d_styledRequests.insert(job.renderKey(), new Request { job.path, job.size, job.scale, QIcon::Normal, job.category == CuteCosmicIconCache::Symbolic });
+    }
+}
+
+CuteCosmicIconRenderer::Job CuteCosmicIconRenderer::createJob(const Request& request)
+{
+    // Only the inputs that actually affect the raster go into the job and its
+    // key, so that theme changes only invalidate the icons that they change.
+    // Icons with a KDE stylesheet are colored by it, symbolic icons without one
+    // are colorized from their mask, and other icons depend on neither.
+    QString iconCss;
+    QColor tint;
+    size_t inputs = 0;
+
+    bool isSvg = cuteCosmicIsSvgFile(request.path);
+
+    if (isSvg && CuteCosmicSvgCache::instance()->hasKdeStylesheet(request.path)) {
+        updateIconCss();
+        iconCss = d_iconCss;
+        inputs = d_iconCssHash;
+    }
+    else if (request.symbolic) {
+        // The mask is colorized for each mode in the same way that text is
+        const QPalette palette = QGuiApplication::palette();
+        switch (request.mode) {
+        case QIcon::Normal:
+        case QIcon::Active:
+            tint = palette.color(QPalette::Active, QPalette::Text);
+            break;
+        case QIcon::Disabled:
+            tint = palette.color(QPalette::Disabled, QPalette::Text);
+            break;
+        case QIcon::Selected:
+            tint = palette.color(QPalette::Active, QPalette::HighlightedText);
+            break;
+        }
+        inputs = tint.rgba();
+    }
+
+    CuteCosmicIconKey key { request.path, request.size.width(), request.scale, request.mode, inputs };
+    CuteCosmicIconKey normalKey = key;
+
+    // The other modes are generated by the application style from the Normal
+    // mode pixmap and the palette
+    if (request.mode != QIcon::Normal && !tint.isValid()) {
+        normalKey.mode = QIcon::Normal;
+        key.inputs = qHashMulti(inputs, QGuiApplication::palette().cacheKey());
+    }
+
+    return Job {
+        key,
+        normalKey,
+        !isSvg ? CuteCosmicIconCache::Raster : request.symbolic ? CuteCosmicIconCache::Symbolic : CuteCosmicIconCache::FullColor,
+        request.path,
+        request.size,
+        request.scale,
+        request.mode,
+        iconCss,
+        tint
+    };
+}
+
+QPixmap CuteCosmicIconRenderer::finishJob(const Job& job, QImage image)
+{
+    if (image.isNull()) {
+        return QPixmap();
+    }
+
+    if (job.isMask()) {
+        CuteCosmicIconKey maskKey = job.maskKey();
+        if (!d_masks.contains(maskKey)) {
+            d_masks.insert(maskKey, new QImage(image), qMax<qsizetype>(image.sizeInBytes(), 1));
+        }
+
+        // The colorized pixmap isn't cached, so that symbolic icons only take
+        // a byte per pixel however many colors they are painted with
+        QImage colorized = cuteCosmicColorizeMask(image, job.tint.rgba());
+        colorized.setDevicePixelRatio(job.scale);
+        return QPixmap::fromImage(std::move(colorized), Qt::NoFormatConversion);
+    }
+
+    // Remember the icons that depend on the stylesheet for theme changes
+    rememberStyledJob(job);
+
+    // The image is already premultiplied ARGB32, the pixmap can take it over
+    // as it is. Setting the ratio here rather than on the pixmap keeps later
+    // users of the cached pixmap from detaching it.
+    image.setDevicePixelRatio(job.scale);
+    QPixmap pixmap = QPixmap::fromImage(std::move(image), Qt::NoFormatConversion);
+
+    // The rendered raster is always the Normal mode one, so keep it around
+    // for deriving other modes
+    QPixmap normal = QGuiApplicationPrivate::instance()->applyQIconStyleHelper(QIcon::Normal, pixmap);
+    if (!job.isDerived()) {
+        d_cache.insert(job.cacheKey, job.category, normal);
+        return normal;
+    }
+
+    d_cache.insert(job.normalKey, job.category, normal);
+    return deriveMode(job, normal);
+}
+
+QPixmap CuteCosmicIconRenderer::deriveMode(const Job& job, const QPixmap& normal)
+{
+    QPixmap result = QGuiApplicationPrivate::instance()->applyQIconStyleHelper(job.mode, normal);
+    d_cache.insert(job.cacheKey, job.category, result);
+    return result;
+}
+
+void CuteCosmicIconRenderer::jobFinished(const Job& job, QImage image)
+{
+    QList<QPointer<QObject>> requesters = d_pendingJobs.take(job.renderKey());
+
+    if (finishJob(job, std::move(image)).isNull()) {
+        // Don't keep trying to render broken files
+        d_failedJobs.insert(job.renderKey());
+        return;
+    }
+
+    for (const QPointer<QObject>& requester : std::as_const(requesters)) {
+        if (requester) {
+            updateRequester(requester);
+        }
+    }
+}
+
+CuteCosmicIconKey CuteCosmicIconRenderer::Job::renderKey() const
+{
+    return isMask() ? maskKey() : normalKey;
+}
+
+CuteCosmicIconKey CuteCosmicIconRenderer::Job::maskKey() const
+{
+    // Masks are the same for every mode and theme
+    return CuteCosmicIconKey { cacheKey.path, cacheKey.size, 0, -1, 0 };
+}
+
+static QImage renderSvgImage(const QString& path, const QSize& size, const QString& iconCss)
+{
+    auto document = CuteCosmicSvgCache::instance()->document(path, iconCss);
+    if (!document || !document->isValid()) {
+        return QImage();
+    }
+
+    return document->render(size);
+}
+
+static QImage renderRasterImage(const QString& path, const QSize& size)
+{
+    QImageReader reader { path };
+    QImage image = reader.read();
+    if (image.isNull()) {
+        return image;
+    }
+
+    // Like QIcon does for image files, scale down but never up
+    if (image.width() > size.width() || image.height() > size.height()) {
+        image = image.scaled(size, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+    }
+
+    image.convertTo(QImage::Format_ARGB32_Premultiplied);
+    return image;
+}
+
+static QByteArray diskCacheKey(const QString& path, const QSize& size, const QString& iconCss, bool mask)
+{
+    QFileInfo info { path };
+
+    QByteArray key = QFile::encodeName(info.canonicalFilePath());
+    key += '|' + QByteArray::number(info.lastModified(QTimeZone::UTC).toMSecsSinceEpoch());
+    key += '|' + QByteArray::number(size.width()) + 'x' + QByteArray::number(size.height());
+    key += mask ? "|mask"_ba : "|argb"_ba;
+    key += '|' + QCryptographicHash::hash(iconCss.toUtf8(), QCryptographicHash::Md5).toHex();
+
+    // The SVG renderers don't produce identical pixels
+    if (CuteCosmicSvgCache::usesResvg() && cuteCosmicIsSvgFile(path)) {
+        key += "|resvg"_ba;
+    }
+    return key;
+}
+
+QImage CuteCosmicIconRenderer::renderImage(const Job& job)
+{
+    // This may run on any thread, so must only touch thread-safe state
+
+    // The persistent cache holds the Normal mode raster or the alpha mask, as
+    // the other modes are generated by the application style and so differ
+    // between processes
+    CuteCosmicIconDiskCache* diskCache = CuteCosmicIconDiskCache::instance();
+    QByteArray diskKey;
+
+    if (diskCache->isEnabled()) {
+        diskKey = diskCacheKey(job.path, job.size, job.iconCss, job.isMask());
+
+        QImage image = diskCache->find(diskKey);
+        if (!image.isNull()) {
+            return image;
+        }
+    }
+
+    QImage image;
+    if (cuteCosmicIsSvgFile(job.path)) {
+        image = renderSvgImage(job.path, job.size, job.iconCss);
+    }
+    else {
+        image = renderRasterImage(job.path, job.size);
+    }
+
+    if (job.isMask()) {
+        image.convertTo(QImage::Format_Alpha8);
+    }
+
+    if (!image.isNull() && diskCache->isEnabled()) {
+        diskCache->insert(diskKey, image);
+    }
+    return image;
+}
+
+#include "moc_cutecosmiciconrenderer.cpp"
@@ -0,0 +1,158 @@
+/*
+ * This file is part of CuteCosmic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <QCache>
+#include <QColor>
+#include <QHash>
+#include <QIcon>
+#include <QMutex>
+#include <QObject>
+#include <QPixmap>
+#include <QPointer>
+#include <QSet>
+#include <QThreadPool>
+
+#include <functional>
+
+#include "cutecosmiciconcache.h"
+
+class CuteCosmicColorManager;
+class CuteCosmicIconProfile;
+
+/*
+ * Renders SVG and raster icon files into pixmaps for the icon engines,
+ * through the in-memory and on-disk caches.
+ *
+ * If the CUTECOSMIC_ASYNC_ICONS environment variable is set, icon engines may
+ * also queue rendering on a thread pool instead of blocking when painting.
+ * Concurrent requests for the same pixmap are coalesced, and once it is ready
+ * the objects that painted the icon are asked to update().
+ *
+ * Symbolic icons without a KDE stylesheet are rendered once per size into an
+ * alpha mask, which is the only thing cached for them. It is colorized for
+ * each palette and mode when a pixmap is requested. For other
+ * icons only the Normal mode is rendered, and the other modes are generated
+ * from it by the application style.
+ *
+ * On theme changes, the icons recently used with the KDE stylesheet are
+ * rendered again with the new one in the background before Qt is told about
+ * the change, so that windows repaint with their icons ready. Until then,
+ * icons keep being painted with the previous stylesheet.
+ *
+ * Icons can also be rendered by name into images, for the Qt Quick image
+ * provider. Only resolving the icon happens on the GUI thread, and the images
+ * are kept in a cache of their own that is safe to use from any thread.
+ */
+class CuteCosmicIconRenderer : public QObject
+{
+    Q_OBJECT
+
+public:
+    struct Request
+    {
+        QString path;
+        QSize size;
+        qreal scale;
+        QIcon::Mode mode;
+        bool symbolic;
+    };
+
+    CuteCosmicIconRenderer(CuteCosmicColorManager* colorManager, QObject* parent = nullptr);
+    ~CuteCosmicIconRenderer();
+
+    bool isAsync() const { return d_async; }
+    CuteCosmicIconProfile* profile() const { return d_profile; }
+    const CuteCosmicIconCache& cache() const { return d_cache; }
+    size_t iconCssHash() const;
+
+    void prewarm();
+
+    QPixmap render(const Request& request);
+    // The requester must be a widget or a QPaintDeviceWindow, if any
+    QPixmap renderAsync(const Request& request, QObject* requester);
+
+    void prepareThemeChange(const std::function<void()>& ready);
+
+    // Can be called from any thread, and calls done exactly once from any
+    // thread - with a null image if the icon can't be rendered
+    void renderImageAsync(const QString& iconName, const QSize& size, QIcon::Mode mode, const std::function<void(const QImage&)>& done);
+
+private:
+    struct Job
+    {
+        CuteCosmicIconKey cacheKey;
+        CuteCosmicIconKey normalKey;
+        CuteCosmicIconCache::Category category;
+        QString path;
+        QSize size;
+        qreal scale;
+        QIcon::Mode mode;
+        QString iconCss;
+        QColor tint;
+
+        // Symbolic icons are rendered into an alpha mask, colorized with tint
+        bool isMask() const { return tint.isValid(); }
+        CuteCosmicIconKey maskKey() const;
+
+        // Other modes are derived from the Normal mode pixmap
+        bool isDerived() const { return normalKey != cacheKey; }
+
+        // The raster that is actually rendered for the job
+        CuteCosmicIconKey renderKey() const;
+    };
+
+    Job createJob(const Request& request);
+    void updateIconCss();
+    void rememberStyledJob(const Job& job);
+    bool findPixmap(const Job& job, QPixmap* result);
+    QPixmap finishJob(const Job& job, QImage image);
+    QPixmap deriveMode(const Job& job, const QPixmap& normal);
+    void jobFinished(const Job& job, QImage image);
+    void themeChangeJobFinished(quint64 generation, const Job& job, QImage image);
+    void finishThemeChange(quint64 generation);
+    void startImageJob(const QString& iconName, const QSize& size, QIcon::Mode mode, const std::function<void(const QImage&)>& done);
+    void insertImage(const CuteCosmicIconKey& key, const QImage& image);
+
+    static QImage renderImage(const Job& job);
+
+    CuteCosmicColorManager* d_colorManager;
+    CuteCosmicIconProfile* d_profile;
+    bool d_async;
+
+    QThreadPool d_threadPool;
+    CuteCosmicIconCache d_cache;
+    QCache<CuteCosmicIconKey, QImage> d_masks;
+    QHash<CuteCosmicIconKey, QList<QPointer<QObject>>> d_pendingJobs;
+    QSet<CuteCosmicIconKey> d_failedJobs;
+    uint d_failedThemeKey;
+
+    // Most recently used icons with the KDE stylesheet, and the stylesheet
+    // that icons are currently painted with
+    QCache<CuteCosmicIconKey, Request> d_styledRequests;
+    QString d_iconCss;
+    size_t d_iconCssHash;
+    QString d_nextIconCss;
+    size_t d_nextIconCssHash;
+    bool d_iconCssHeld;
+    std::function<void()> d_themeChangeReady;
+    quint64 d_themeChangeGeneration;
+    int d_themeChangeJobs;
+
+    QMutex d_imagesMutex;
+    QCache<CuteCosmicIconKey, QImage> d_images;
+};
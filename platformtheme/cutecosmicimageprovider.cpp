@@ -0,0 +1,136 @@
+/*
+ * This file is part of CuteCosmic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "cutecosmicimageprovider.h"
+#include "cutecosmiciconrenderer.h"
+
+#include <QQmlEngine>
+
+using namespace Qt::StringLiterals;
+
+static constexpr QLatin1StringView PROVIDER_ID = "cosmicicon"_L1;
+
+// Used when the image has no sourceSize
+static constexpr int DEFAULT_ICON_SIZE = 32;
+
+static const char* modeName(QIcon::Mode mode)
+{
+    switch (mode) {
+    case QIcon::Normal:
+        return "normal";
+    case QIcon::Disabled:
+        return "disabled";
+    case QIcon::Active:
+        return "active";
+    case QIcon::Selected:
+        return "selected";
+    }
+    return "normal";
+}
+
+static QIcon::Mode parseMode(QStringView name)
+{
+    for (QIcon::Mode mode : { QIcon::Disabled, QIcon::Active, QIcon::Selected }) {
+        if (name == QLatin1StringView(modeName(mode))) {
+            return mode;
+        }
+    }
+    return QIcon::Normal;
+}
+
+CuteCosmicImageProvider::CuteCosmicImageProvider(CuteCosmicIconRenderer* renderer)
+    : d_renderer(renderer)
+{
+}
+
+QQuickImageResponse* CuteCosmicImageProvider::requestImageResponse(const QString& id, const QSize& requestedSize)
+{
+    // Icon names never contain slashes, so whatever follows one is the mode
+    qsizetype separator = id.indexOf(u'/');
+    QString iconName = id.left(separator);
+    QIcon::Mode mode = (separator >= 0) ? parseMode(QStringView(id).mid(separator + 1)) : QIcon::Normal;
+
+    QSize size = requestedSize;
+    if (size.width() <= 0 || size.height() <= 0) {
+        size = QSize(DEFAULT_ICON_SIZE, DEFAULT_ICON_SIZE);
+    }
+
+    auto* response = new CuteCosmicImageResponse();
+
+    std::shared_ptr<CuteCosmicImageResponse::State> state = response->state();
+    d_renderer->renderImageAsync(iconName, size, mode, [state](const QImage& image) {
+        QMutexLocker locker { &state->mutex };
+        if (state->response) {
+            state->response->setImage(image);
+        }
+    });
+
+    return response;
+}
+
+void CuteCosmicImageProvider::registerQmlModule(CuteCosmicIconRenderer* renderer)
+{
+    // The provider can only be added to each engine, and there is no telling
+    // when one is created. Adding it along with the singleton makes sure it's
+    // there before any URL the singleton returns is loaded.
+    qmlRegisterSingletonType<CuteCosmicQmlIcons>("org.cutecosmic", 1, 0, "Icons", [renderer](QQmlEngine* engine, QJSEngine*) -> QObject* {
+        if (!engine->imageProvider(PROVIDER_ID)) {
+            engine->addImageProvider(PROVIDER_ID, new CuteCosmicImageProvider(renderer));
+        }
+        return new CuteCosmicQmlIcons();
+    });
+}
+
+CuteCosmicImageResponse::CuteCosmicImageResponse()
+    : d_state(std::make_shared<State>())
+{
+    d_state->response = this;
+}
+
+CuteCosmicImageResponse::~CuteCosmicImageResponse()
+{
+    // Blocks until a callback that is delivering the image is done with it
+    QMutexLocker locker { &d_state->mutex };
+    d_state->response = nullptr;
+}
+
+void CuteCosmicImageResponse::setImage(const QImage& image)
+{
+    // Qt Quick allows finished() to be emitted from any thread
+    d_image = image;
+    Q_EMIT finished();
+}
+
+QQuickTextureFactory* CuteCosmicImageResponse::textureFactory() const
+{
+    return QQuickTextureFactory::textureFactoryForImage(d_image);
+}
+
+QString CuteCosmicImageResponse::errorString() const
+{
+    return d_image.isNull() ? "Icon not found"_L1 : QString();
+}
+
+QUrl CuteCosmicQmlIcons::url(const QString& iconName, const QString& mode) const
+{
+    QString id = iconName;
+    if (!mode.isEmpty()) {
+        id += u'/' + mode;
+    }
+    return QUrl("image://"_L1 + PROVIDER_ID + u'/' + id);
+}
+
+#include "moc_cutecosmicimageprovider.cpp"
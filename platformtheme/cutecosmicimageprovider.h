@@ -0,0 +1,88 @@
+/*
+ * This file is part of CuteCosmic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <QImage>
+#include <QMutex>
+#include <QQuickAsyncImageProvider>
+#include <QUrl>
+
+#include <memory>
+
+class CuteCosmicIconRenderer;
+
+/*
+ * Renders theme icons for Qt Quick, as "image://cosmicicon/<name>" sources,
+ * without blocking the GUI thread. A mode other than Normal can be given as
+ * in "image://cosmicicon/<name>/disabled". The size is taken from the
+ * sourceSize of the image.
+ *
+ * The provider is added to a QML engine when the Icons singleton of the
+ * "org.cutecosmic" module is first used in it, e.g:
+ *
+ *   import org.cutecosmic
+ *   Image { source: Icons.url("edit-copy"); sourceSize: Qt.size(22, 22) }
+ */
+class CuteCosmicImageProvider : public QQuickAsyncImageProvider
+{
+public:
+    CuteCosmicImageProvider(CuteCosmicIconRenderer* renderer);
+
+    QQuickImageResponse* requestImageResponse(const QString& id, const QSize& requestedSize) override;
+
+    static void registerQmlModule(CuteCosmicIconRenderer* renderer);
+
+private:
+    CuteCosmicIconRenderer* d_renderer;
+};
+
+class CuteCosmicImageResponse : public QQuickImageResponse
+{
+    Q_OBJECT
+
+public:
+    // Shared with the renderer callback, which may outlive the response
+    struct State
+    {
+        QMutex mutex;
+        CuteCosmicImageResponse* response;
+    };
+
+    CuteCosmicImageResponse();
+    ~CuteCosmicImageResponse();
+
+    std::shared_ptr<State> state() const { return d_state; }
+    void setImage(const QImage& image);
+
+    QQuickTextureFactory* textureFactory() const override;
+    QString errorString() const override;
+
+private:
+    std::shared_ptr<State> d_state;
+    QImage d_image;
+};
+
+// The "Icons" singleton of the "org.cutecosmic" QML module
+class CuteCosmicQmlIcons : public QObject
+{
+    Q_OBJECT
+
+public:
+    using QObject::QObject;
+
+    Q_INVOKABLE QUrl url(const QString& iconName, const QString& mode = QString()) const;
+};
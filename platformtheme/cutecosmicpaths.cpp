@@ -0,0 +1,40 @@
+/*
+ * This file is part of CuteCosmic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "cutecosmicpaths.h"
+
+#include <QDir>
+#include <QStandardPaths>
+
+using namespace Qt::StringLiterals;
+
+QString cuteCosmicCacheDirectory()
+{
+    static const QString directory = []() {
+        QString location = QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation);
+        if (location.isEmpty()) {
+            return QString();
+        }
+
+        QString path = location + "/cutecosmic"_L1;
+        if (!QDir().mkpath(path)) {
+            return QString();
+        }
+        return path;
+    }();
+
+    return directory;
+}
@@ -0,0 +1,175 @@
+/*
+ * This file is part of CuteCosmic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "cutecosmicrecolor.h"
+
+#include <QtCore/private/qsimd_p.h>
+
+#if defined(Q_PROCESSOR_X86)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/*
+ * All the kernels compute the same thing - the tint color premultiplied by
+ * the alpha of the source pixel, using the same rounding as qPremultiply().
+ * As the source alpha is always at the top byte of the 32 bit formats we take
+ * as input, it doesn't matter if the source is premultiplied or not.
+ */
+
+using RecolorFunction = void (*)(quint32* pixels, qsizetype count, QRgb color);
+
+static void recolorScalar(quint32* pixels, qsizetype count, QRgb color)
+{
+    const QRgb rgb = color & RGB_MASK;
+    for (qsizetype i = 0; i < count; i++) {
+        pixels[i] = qPremultiply((pixels[i] & ~RGB_MASK) | rgb);
+    }
+}
+
+#if defined(Q_PROCESSOR_X86) && defined(__SSE2__)
+
+static inline __m128i divideBy255Sse2(__m128i value)
+{
+    value = _mm_add_epi16(value, _mm_srli_epi16(value, 8));
+    value = _mm_add_epi16(value, _mm_set1_epi16(0x80));
+    return _mm_srli_epi16(value, 8);
+}
+
+static void recolorSse2(quint32* pixels, qsizetype count, QRgb color)
+{
+    // The tint as 16 bit channels of two pixels. The alpha channel is set to
+    // 255 so multiplying by it keeps the source alpha.
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i tint = _mm_unpacklo_epi8(_mm_set1_epi32(int(color | ~RGB_MASK)), zero);
+
+    qsizetype i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i* p = reinterpret_cast<__m128i*>(pixels + i);
+
+        // Broadcast the alpha of each pixel to all of its channels
+        __m128i alpha = _mm_srli_epi32(_mm_loadu_si128(p), 24);
+        alpha = _mm_or_si128(alpha, _mm_slli_epi32(alpha, 8));
+        alpha = _mm_or_si128(alpha, _mm_slli_epi32(alpha, 16));
+
+        __m128i lo = divideBy255Sse2(_mm_mullo_epi16(_mm_unpacklo_epi8(alpha, zero), tint));
+        __m128i hi = divideBy255Sse2(_mm_mullo_epi16(_mm_unpackhi_epi8(alpha, zero), tint));
+
+        _mm_storeu_si128(p, _mm_packus_epi16(lo, hi));
+    }
+
+    recolorScalar(pixels + i, count - i, color);
+}
+
+QT_FUNCTION_TARGET(AVX2)
+static inline __m256i divideBy255Avx2(__m256i value)
+{
+    value = _mm256_add_epi16(value, _mm256_srli_epi16(value, 8));
+    value = _mm256_add_epi16(value, _mm256_set1_epi16(0x80));
+    return _mm256_srli_epi16(value, 8);
+}
+
+QT_FUNCTION_TARGET(AVX2)
+static void recolorAvx2(quint32* pixels, qsizetype count, QRgb color)
+{
+    // Same as the SSE2 version, unpacking and packing work within each 128 bit
+    // lane so the pixel order is kept
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i tint = _mm256_unpacklo_epi8(_mm256_set1_epi32(int(color | ~RGB_MASK)), zero);
+
+    qsizetype i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i* p = reinterpret_cast<__m256i*>(pixels + i);
+
+        __m256i alpha = _mm256_srli_epi32(_mm256_loadu_si256(p), 24);
+        alpha = _mm256_or_si256(alpha, _mm256_slli_epi32(alpha, 8));
+        alpha = _mm256_or_si256(alpha, _mm256_slli_epi32(alpha, 16));
+
+        __m256i lo = divideBy255Avx2(_mm256_mullo_epi16(_mm256_unpacklo_epi8(alpha, zero), tint));
+        __m256i hi = divideBy255Avx2(_mm256_mullo_epi16(_mm256_unpackhi_epi8(alpha, zero), tint));
+
+        _mm256_storeu_si256(p, _mm256_packus_epi16(lo, hi));
+    }
+
+    recolorSse2(pixels + i, count - i, color);
+}
+
+#elif defined(__ARM_NEON)
+
+static inline uint8x8_t divideBy255Neon(uint16x8_t value)
+{
+    value = vaddq_u16(value, vshrq_n_u16(value, 8));
+    value = vaddq_u16(value, vdupq_n_u16(0x80));
+    return vshrn_n_u16(value, 8);
+}
+
+static void recolorNeon(quint32* pixels, qsizetype count, QRgb color)
+{
+    const uint8x8_t tint = vreinterpret_u8_u32(vdup_n_u32(color | ~RGB_MASK));
+
+    qsizetype i = 0;
+    for (; i + 4 <= count; i += 4) {
+        // Broadcast the alpha of each pixel to all of its channels
+        uint32x4_t alpha = vshrq_n_u32(vld1q_u32(pixels + i), 24);
+        uint8x16_t alpha8 = vreinterpretq_u8_u32(vmulq_n_u32(alpha, 0x01010101));
+
+        uint8x8_t lo = divideBy255Neon(vmull_u8(vget_low_u8(alpha8), tint));
+        uint8x8_t hi = divideBy255Neon(vmull_u8(vget_high_u8(alpha8), tint));
+
+        vst1q_u32(pixels + i, vreinterpretq_u32_u8(vcombine_u8(lo, hi)));
+    }
+
+    recolorScalar(pixels + i, count - i, color);
+}
+
+#endif
+
+static RecolorFunction selectRecolorFunction()
+{
+#if defined(Q_PROCESSOR_X86) && defined(__SSE2__)
+    if (qCpuHasFeature(AVX2)) {
+        return recolorAvx2;
+    }
+    return recolorSse2;
+#elif defined(__ARM_NEON)
+    return recolorNeon;
+#else
+    return recolorScalar;
+#endif
+}
+
+static const RecolorFunction recolor = selectRecolorFunction();
+
+QImage cuteCosmicColorizeMask(const QImage& mask, QRgb color)
+{
+    QImage alpha = mask.format() == QImage::Format_Alpha8 ? mask : mask.convertToFormat(QImage::Format_Alpha8);
+
+    QImage image { alpha.size(), QImage::Format_ARGB32_Premultiplied };
+    image.setDevicePixelRatio(alpha.devicePixelRatio());
+
+    // Each row is expanded and then recolored while it is still in the cache
+    for (int y = 0; y < image.height(); y++) {
+        const uchar* src = alpha.constScanLine(y);
+        quint32* dst = reinterpret_cast<quint32*>(image.scanLine(y));
+        for (int x = 0; x < image.width(); x++) {
+            dst[x] = quint32(src[x]) << 24;
+        }
+        recolor(dst, image.width(), color);
+    }
+
+    return image;
+}
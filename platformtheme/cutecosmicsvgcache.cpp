@@ -0,0 +1,305 @@
+/*
+ * This file is part of CuteCosmic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "cutecosmicsvgcache.h"
+
+#include "bindings.h"
+
+#include <QBuffer>
+#include <QFile>
+#include <QPainter>
+#include <QXmlStreamReader>
+
+using namespace Qt::StringLiterals;
+
+// Roughly the size of the preprocessed sources of all cached documents
+static constexpr qsizetype MAX_CACHE_COST = 4 * 1024 * 1024;
+
+static constexpr QByteArrayView KDE_STYLESHEET_ID = "current-color-scheme";
+
+Q_GLOBAL_STATIC(CuteCosmicSvgCache, s_svgCache)
+
+CuteCosmicSvgDocument::CuteCosmicSvgDocument(const QByteArray& contents, bool isKdeSymbolic)
+    : d_kdeSymbolic(isKdeSymbolic)
+{
+#ifdef CUTECOSMIC_RESVG
+    d_resvg = nullptr;
+    if (CuteCosmicSvgCache::usesResvg()) {
+        d_resvg = libcosmic_svg_load(reinterpret_cast<const uint8_t*>(contents.constData()), contents.size());
+        d_valid = d_resvg != nullptr;
+        return;
+    }
+#endif
+
+    // Documents may be created and rendered on any thread, so make sure the
+    // renderer never starts an animation timer
+    d_renderer.setAnimationEnabled(false);
+    d_valid = d_renderer.load(contents);
+}
+
+CuteCosmicSvgDocument::~CuteCosmicSvgDocument()
+{
+#ifdef CUTECOSMIC_RESVG
+    libcosmic_svg_free(d_resvg);
+#endif
+}
+
+QImage CuteCosmicSvgDocument::render(const QSize& size)
+{
+    if (!d_valid || size.isEmpty()) {
+        return QImage();
+    }
+
+    QImage image { size, QImage::Format_ARGB32_Premultiplied };
+    image.fill(Qt::transparent);
+
+#ifdef CUTECOSMIC_RESVG
+    // Unlike QSvgRenderer, resvg documents are immutable once parsed, so they
+    // can be rendered from many threads at once
+    if (d_resvg) {
+        if (!libcosmic_svg_render(d_resvg, image.bits(), image.width(), image.height(), image.bytesPerLine())) {
+            return QImage();
+        }
+        return image;
+    }
+#endif
+
+    {
+        QMutexLocker locker { &d_mutex };
+        QPainter painter { &image };
+        d_renderer.render(&painter, QRectF(QPointF(0, 0), size));
+    }
+
+    return image;
+}
+
+static bool isOnKdeStylesheetElement(const QXmlStreamReader& reader)
+{
+    return reader.isStartElement()
+        && reader.name() == "style"_L1
+        && reader.attributes().value("type"_L1) == "text/css"_L1
+        && reader.attributes().value("id"_L1) == "current-color-scheme"_L1;
+}
+
+static bool preprocessSvgIcon(QIODevice* in, QIODevice* out, const QString& iconCss)
+{
+    QXmlStreamReader reader { in };
+    QXmlStreamWriter writer { out };
+
+    bool isKdeSymbolic = false;
+
+    while (!reader.atEnd()) {
+        reader.readNext();
+        if (reader.error() != QXmlStreamReader::NoError) {
+            break;
+        }
+
+        if (isOnKdeStylesheetElement(reader)) {
+            writer.writeStartElement("style");
+            writer.writeAttributes(reader.attributes());
+            writer.writeCharacters(iconCss);
+            writer.writeEndElement();
+
+            while (reader.tokenType() != QXmlStreamReader::EndElement && reader.error() == QXmlStreamReader::NoError) {
+                reader.readNext();
+            }
+            isKdeSymbolic = true;
+        }
+        else {
+            writer.writeCurrentToken(reader);
+        }
+    }
+
+    return isKdeSymbolic;
+}
+
+static bool isXmlSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Replaces the contents of the KDE stylesheet element without parsing the
+// whole document. Only the usual simple layout of the element is handled, if
+// anything looks unusual this returns false and the XML parser must be used.
+static bool spliceKdeStylesheet(QByteArrayView contents, QByteArrayView css, QByteArray* out)
+{
+    qsizetype id = contents.indexOf(KDE_STYLESHEET_ID);
+    if (id < 0 || contents.indexOf(KDE_STYLESHEET_ID, id + 1) >= 0) {
+        return false;
+    }
+
+    qsizetype tagStart = contents.lastIndexOf('<', id);
+    qsizetype tagEnd = contents.indexOf('>', id);
+    if (tagStart < 0 || tagEnd < 0) {
+        return false;
+    }
+
+    QByteArrayView tag = contents.sliced(tagStart, tagEnd + 1 - tagStart);
+    if (!tag.startsWith("<style"_ba) || tag.size() < 7 || !isXmlSpace(tag.at(6)) || !tag.contains("text/css"_ba)) {
+        return false;
+    }
+
+    out->reserve(contents.size() + css.size() + 8);
+
+    if (tag.endsWith("/>"_ba)) {
+        out->append(contents.first(tagEnd - 1));
+        out->append('>');
+        out->append(css);
+        out->append("</style>");
+        out->append(contents.sliced(tagEnd + 1));
+        return true;
+    }
+
+    qsizetype close = contents.indexOf("</style>"_ba, tagEnd);
+    if (close < 0) {
+        return false;
+    }
+
+    out->append(contents.first(tagEnd + 1));
+    out->append(css);
+    out->append(contents.sliced(close));
+    return true;
+}
+
+static bool isCompressed(QByteArrayView contents)
+{
+    return contents.startsWith("\x1f\x8b"_ba);
+}
+
+CuteCosmicSvgCache::CuteCosmicSvgCache()
+    : d_documents(MAX_CACHE_COST)
+    , d_hits(0)
+    , d_misses(0)
+{
+}
+
+CuteCosmicSvgCache* CuteCosmicSvgCache::instance()
+{
+    return s_svgCache();
+}
+
+bool CuteCosmicSvgCache::usesResvg()
+{
+#ifdef CUTECOSMIC_RESVG
+    static const bool resvg = qEnvironmentVariable("CUTECOSMIC_SVG_RENDERER") == "resvg"_L1;
+    return resvg;
+#else
+    return false;
+#endif
+}
+
+std::shared_ptr<CuteCosmicSvgDocument> CuteCosmicSvgCache::document(const QString& path, const QString& iconCss)
+{
+    Key key { path, iconCss };
+
+    {
+        QMutexLocker locker { &d_mutex };
+
+        // Documents without a KDE stylesheet don't depend on it
+        auto it = d_kdeStylesheets.constFind(path);
+        if (it != d_kdeStylesheets.constEnd() && !*it) {
+            key.second = QString();
+        }
+
+        if (auto* document = d_documents.object(key)) {
+            d_hits++;
+            return *document;
+        }
+    }
+
+    d_misses++;
+
+    QFile file { path };
+    if (!file.open(QFile::ReadOnly)) {
+        return nullptr;
+    }
+
+    // The file is mapped rather than read, so that icons without a KDE
+    // stylesheet (most of them) are loaded straight from the page cache
+    QByteArray contents;
+    if (uchar* data = file.size() > 0 ? file.map(0, file.size()) : nullptr) {
+        contents = QByteArray::fromRawData(reinterpret_cast<const char*>(data), file.size());
+    }
+    else {
+        contents = file.readAll();
+    }
+
+    bool isKdeSymbolic = false;
+
+    if (!isCompressed(contents) && contents.contains(KDE_STYLESHEET_ID)) {
+        QByteArray css = iconCss.toUtf8();
+        QByteArray preprocessed;
+
+        // Stylesheets that would need escaping are left to the XML writer
+        if (!css.contains('<') && !css.contains('&') && spliceKdeStylesheet(contents, css, &preprocessed)) {
+            isKdeSymbolic = true;
+        }
+        else {
+            QBuffer in { &contents };
+            QBuffer out { &preprocessed };
+            if (!in.open(QBuffer::ReadOnly) || !out.open(QBuffer::WriteOnly)) {
+                return nullptr;
+            }
+            isKdeSymbolic = preprocessSvgIcon(&in, &out, iconCss);
+        }
+
+        contents = preprocessed;
+    }
+
+    // The renderer doesn't keep the contents once loaded, so the mapping can
+    // go away afterwards
+    qsizetype cost = qMax<qsizetype>(contents.size(), 1);
+    auto document = std::make_shared<CuteCosmicSvgDocument>(contents, isKdeSymbolic);
+
+    if (!isKdeSymbolic) {
+        key.second = QString();
+    }
+
+    QMutexLocker locker { &d_mutex };
+    d_kdeStylesheets.insert(path, isKdeSymbolic);
+    d_documents.insert(key, new std::shared_ptr<CuteCosmicSvgDocument>(document), cost);
+    return document;
+}
+
+bool CuteCosmicSvgCache::hasKdeStylesheet(const QString& path)
+{
+    {
+        QMutexLocker locker { &d_mutex };
+
+        auto it = d_kdeStylesheets.constFind(path);
+        if (it != d_kdeStylesheets.constEnd()) {
+            return *it;
+        }
+    }
+
+    // Only a byte scan, as this is asked before looking the icon up in the
+    // disk cache and so must not cost a parse
+    QFile file { path };
+    if (!file.open(QFile::ReadOnly) || file.size() <= 0) {
+        return false;
+    }
+
+    bool result = false;
+    if (uchar* data = file.map(0, file.size())) {
+        QByteArrayView contents { reinterpret_cast<const char*>(data), file.size() };
+        result = !isCompressed(contents) && contents.contains(KDE_STYLESHEET_ID);
+        file.unmap(data);
+    }
+
+    QMutexLocker locker { &d_mutex };
+    d_kdeStylesheets.insert(path, result);
+    return result;
+}
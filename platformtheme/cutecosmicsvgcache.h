@@ -0,0 +1,87 @@
+/*
+ * This file is part of CuteCosmic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <QCache>
+#include <QImage>
+#include <QMutex>
+#include <QSvgRenderer>
+
+#include <atomic>
+#include <memory>
+
+#ifdef CUTECOSMIC_RESVG
+struct CosmicSvg;
+#endif
+
+// A preprocessed and parsed SVG icon, that can be rendered at any size
+class CuteCosmicSvgDocument
+{
+public:
+    CuteCosmicSvgDocument(const QByteArray& contents, bool isKdeSymbolic);
+    ~CuteCosmicSvgDocument();
+
+    bool isValid() const { return d_valid; }
+    bool isKdeSymbolic() const { return d_kdeSymbolic; }
+
+    QImage render(const QSize& size);
+
+private:
+    QMutex d_mutex;
+    QSvgRenderer d_renderer;
+#ifdef CUTECOSMIC_RESVG
+    CosmicSvg* d_resvg;
+#endif
+    bool d_valid;
+    bool d_kdeSymbolic;
+};
+
+/*
+ * Per-process cache of parsed SVG icon documents, so that rendering an icon
+ * at a new size or mode doesn't need to read and parse it again. Documents are
+ * keyed by the file path and the KDE icon stylesheet they were preprocessed
+ * with (if they have one), and cost approximately as much as their
+ * preprocessed source.
+ *
+ * If built with the CUTECOSMIC_RESVG option, setting the
+ * CUTECOSMIC_SVG_RENDERER environment variable to "resvg" renders documents
+ * with resvg instead of QtSvg.
+ */
+class CuteCosmicSvgCache
+{
+public:
+    CuteCosmicSvgCache();
+
+    static CuteCosmicSvgCache* instance();
+    static bool usesResvg();
+
+    std::shared_ptr<CuteCosmicSvgDocument> document(const QString& path, const QString& iconCss);
+    bool hasKdeStylesheet(const QString& path);
+
+    qint64 hits() const { return d_hits; }
+    qint64 misses() const { return d_misses; }
+
+private:
+    using Key = std::pair<QString, QString>;
+
+    QMutex d_mutex;
+    QCache<Key, std::shared_ptr<CuteCosmicSvgDocument>> d_documents;
+    QHash<QString, bool> d_kdeStylesheets;
+
+    std::atomic<qint64> d_hits;
+    std::atomic<qint64> d_misses;
+};
@@ -18,10 +18,14 @@
 #include "cutecosmiccolormanager.h"
 #include "cutecosmicfiledialog.h"
 #include "cutecosmiciconengine.h"
+#include "cutecosmiciconrenderer.h"
+#include "cutecosmicimageprovider.h"
 #include "cutecosmicwatcher.h"
 
 #include "bindings.h"
 
+#include <QtCore/private/qfactoryloader_p.h>
+
 #include <qpa/qwindowsysteminterface.h>
 
 #include <QDir>
@@ -101,9 +105,14 @@ CuteCosmicPlatformThemePrivate::CuteCosmicPlatformThemePrivate()
     connect(d_watcher, &CuteCosmicWatcher::themeChanged, this, &CuteCosmicPlatformThemePrivate::themeChanged);
 
     d_colorManager = new CuteCosmicColorManager(this);
+    d_iconRenderer = new CuteCosmicIconRenderer(d_colorManager, this);
+    CuteCosmicImageProvider::registerQmlModule(d_iconRenderer);
 
     reloadTheme();
+    checkWidgetsStyle();
     setQtQuickStyle();
+
+    d_iconRenderer->prewarm();
 }
 
 void CuteCosmicPlatformThemePrivate::reloadTheme()
@@ -162,6 +171,54 @@ void CuteCosmicPlatformThemePrivate::setQtQuickStyle()
         // Workaround in qqc2-desktop-style to have it use our icon engine
         // See https://invent.kde.org/frameworks/qqc2-desktop-style/-/work_items/16
         qApp->setProperty("QQC2_DESKTOP_USE_QICON_FROM_THEME", true);
+
+        // The style gets its colors through KColorScheme, which it may load
+        // and read before we'd notice
+        d_colorManager->requireKdeColors();
+    }
+}
+
+QStringList CuteCosmicPlatformThemePrivate::styleNames()
+{
+    QStringList styles;
+    if (qEnvironmentVariableIsSet("CUTECOSMIC_DEFAULT_STYLE")) {
+        styles << qEnvironmentVariable("CUTECOSMIC_DEFAULT_STYLE");
+    }
+    styles << "Breeze"_L1 << "Fusion"_L1;
+    return styles;
+}
+
+void CuteCosmicPlatformThemePrivate::checkWidgetsStyle()
+{
+    // QApplication creates its style right after the platform theme, and
+    // KDE styles read their colors through KColorScheme as they are created.
+    // Resolve the style the same way QApplication does (minus the -style
+    // argument) to know if the color scheme is needed right away.
+    if (!qApp->inherits("QApplication")) {
+        return;
+    }
+
+    QStringList candidates = styleNames();
+    QString styleOverride = qEnvironmentVariable("QT_STYLE_OVERRIDE");
+    if (!styleOverride.isEmpty()) {
+        candidates.prepend(styleOverride);
+    }
+
+    QFactoryLoader loader { "org.qt-project.Qt.QStyleFactoryInterface", "/styles"_L1, Qt::CaseInsensitive };
+    const QStringList installed = loader.keyMap().values();
+
+    for (const QString& candidate : std::as_const(candidates)) {
+        if (candidate.compare("Fusion"_L1, Qt::CaseInsensitive) == 0
+            || candidate.compare("Windows"_L1, Qt::CaseInsensitive) == 0) {
+            return;
+        }
+        if (installed.contains(candidate, Qt::CaseInsensitive)) {
+            if (candidate.compare("Breeze"_L1, Qt::CaseInsensitive) == 0
+                || candidate.compare("Oxygen"_L1, Qt::CaseInsensitive) == 0) {
+                d_colorManager->requireKdeColors();
+            }
+            return;
+        }
     }
 }
 
@@ -175,8 +232,41 @@ void CuteCosmicPlatformThemePrivate::themeChanged()
         return;
     }
 
+    ThemeState previous = themeState();
     reloadTheme();
-    QWindowSystemInterface::handleThemeChange();
+    ThemeState current = themeState();
+
+    // Plenty of COSMIC settings (e.g the panel or window hint colors) don't
+    // concern Qt at all, and a theme change makes Qt repolish every widget
+    // in every window, so only do that if needed
+    if (current == previous) {
+        qCDebug(lcCuteCosmic(), "COSMIC theme changed, but nothing Qt uses did");
+        return;
+    }
+
+    // Icons that depend on the theme colors are rendered again before Qt
+    // repaints everything with the new theme
+    d_iconRenderer->prepareThemeChange([]() { QWindowSystemInterface::handleThemeChange(); });
+}
+
+static std::optional<QPalette> copyPalette(const QPalette* palette)
+{
+    return palette ? std::optional<QPalette>(*palette) : std::nullopt;
+}
+
+CuteCosmicPlatformThemePrivate::ThemeState CuteCosmicPlatformThemePrivate::themeState() const
+{
+    return ThemeState {
+        copyPalette(d_colorManager->systemPalette()),
+        copyPalette(d_colorManager->menuPalette()),
+        copyPalette(d_colorManager->buttonPalette()),
+        d_interfaceFont ? d_interfaceFont->toString() : QString(),
+        d_monospaceFont ? d_monospaceFont->toString() : QString(),
+        consumeRustString(libcosmic_theme_icon_theme()),
+        libcosmic_theme_is_dark(),
+        libcosmic_theme_is_high_contrast(),
+        d_colorManager->iconCssHash()
+    };
 }
 
 CuteCosmicPlatformTheme::CuteCosmicPlatformTheme()
@@ -241,12 +331,7 @@ QVariant CuteCosmicPlatformTheme::themeHint(ThemeHint hint) const
         return "breeze"_L1;
     }
     else if (hint == QPlatformTheme::StyleNames) {
-        QStringList styles;
-        if (qEnvironmentVariableIsSet("CUTECOSMIC_DEFAULT_STYLE")) {
-            styles << qEnvironmentVariable("CUTECOSMIC_DEFAULT_STYLE");
-        }
-        styles << "Breeze"_L1 << "Fusion"_L1;
-        return styles;
+        return CuteCosmicPlatformThemePrivate::styleNames();
     }
 
     return QGenericUnixTheme::themeHint(hint);
@@ -254,7 +339,7 @@ QVariant CuteCosmicPlatformTheme::themeHint(ThemeHint hint) const
 
 QIconEngine* CuteCosmicPlatformTheme::createIconEngine(const QString& iconName) const
 {
-    return new CuteCosmicIconEngine(iconName, d_ptr->d_colorManager);
+    return new CuteCosmicIconEngine(iconName, d_ptr->d_iconRenderer);
 }
 
 Qt::ColorScheme CuteCosmicPlatformTheme::colorScheme() const
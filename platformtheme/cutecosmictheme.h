@@ -17,8 +17,10 @@
 #pragma once
 
 #include <QObject>
+#include <QPalette>
 
 #include <memory>
+#include <optional>
 
 #if QT_VERSION >= QT_VERSION_CHECK(6, 10, 0)
 #include <QtGui/private/qgenericunixtheme_p.h>
@@ -27,6 +29,7 @@
 #endif
 
 class CuteCosmicColorManager;
+class CuteCosmicIconRenderer;
 class CuteCosmicWatcher;
 
 class CuteCosmicPlatformThemePrivate : public QObject
@@ -46,8 +49,42 @@ private Q_SLOTS:
 private:
     friend class CuteCosmicPlatformTheme;
 
+    static QStringList styleNames();
+    void checkWidgetsStyle();
+
+    // Everything from the COSMIC configuration that Qt gets to see, to tell
+    // which configuration changes actually concern it
+    struct ThemeState
+    {
+        std::optional<QPalette> systemPalette;
+        std::optional<QPalette> menuPalette;
+        std::optional<QPalette> buttonPalette;
+        QString interfaceFont;
+        QString monospaceFont;
+        QString iconTheme;
+        bool dark;
+        bool highContrast;
+        size_t iconCssHash;
+
+        friend bool operator==(const ThemeState& lhs, const ThemeState& rhs)
+        {
+            return lhs.systemPalette == rhs.systemPalette
+                && lhs.menuPalette == rhs.menuPalette
+                && lhs.buttonPalette == rhs.buttonPalette
+                && lhs.interfaceFont == rhs.interfaceFont
+                && lhs.monospaceFont == rhs.monospaceFont
+                && lhs.iconTheme == rhs.iconTheme
+                && lhs.dark == rhs.dark
+                && lhs.highContrast == rhs.highContrast
+                && lhs.iconCssHash == rhs.iconCssHash;
+        }
+    };
+
+    ThemeState themeState() const;
+
     CuteCosmicWatcher* d_watcher;
     CuteCosmicColorManager* d_colorManager;
+    CuteCosmicIconRenderer* d_iconRenderer;
 
     bool d_firstThemeChange;
     Qt::ColorScheme d_requestedScheme;
@@ -0,0 +1,38 @@
+/*
+ * This file is part of CuteCosmic.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <QByteArrayView>
+#include <QString>
+
+// FNV-1a, for hashes that are written to disk and so must be stable between
+// processes and Qt versions, unlike qHash().
+inline quint64 cuteCosmicStableHash(QByteArrayView data)
+{
+    quint64 hash = 14695981039346656037ULL;
+    for (char c : data) {
+        hash ^= static_cast<quint8>(c);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+inline bool cuteCosmicIsSvgFile(const QString& path)
+{
+    using namespace Qt::StringLiterals;
+    return path.endsWith(".svg"_L1) || path.endsWith(".svgz"_L1);
+}